@@ -91,12 +91,16 @@ public:
     void                putString(const char* string);
     void                putString(const uint16_t* string);
     inline void         putEmptyString() { putUInt8(0); }
+    // appends data that is already in wire format
+    void                putBytes(const void* data, size_t length);
     inline void         putEmptyArray() { putUInt32(0); }
 
 
 #ifdef MTP_DEVICE
     // fill our buffer with data from the given file descriptor
     int                 read(int fd);
+    // read a whole data phase, which may take several transfers
+    int                 readDataPhase(int fd);
 
     // write our data to the given file descriptor
     int                 write(int fd);
@@ -116,6 +120,7 @@ public:
 #endif
 
     inline bool         hasData() const { return mPacketSize > MTP_CONTAINER_HEADER_SIZE; }
+    inline size_t       getDataLength() const { return hasData() ? mPacketSize - MTP_CONTAINER_HEADER_SIZE : 0; }
     inline uint32_t     getContainerLength() const { return MtpPacket::getUInt32(MTP_CONTAINER_LENGTH_OFFSET); }
     void*               getData(int* outLength) const;
 };
@@ -55,6 +55,11 @@ public:
                                             MtpObjectFormat format,
                                             bool succeeded) = 0;
 
+    // called around changes the server makes to a path on disk itself,
+    // so that they can be told apart from changes made by others
+    virtual void                    beginPathMutation(const MtpString& path) = 0;
+    virtual void                    endPathMutation(const MtpString& path) = 0;
+
     virtual MtpObjectHandleList*    getObjectList(MtpStorageID storageID,
                                             MtpObjectFormat format,
                                             MtpObjectHandle parent) = 0;
@@ -116,6 +121,9 @@ public:
 
     virtual MtpProperty*            getDevicePropertyDesc(MtpDeviceProperty property) = 0;
 
+    // changes whenever the result of a query could, 0 if that isn't tracked
+    virtual uint64_t                getGeneration() { return 0; }
+
     virtual void                    sessionStarted(MtpServer* server) = 0;
 
     virtual void                    sessionEnded() = 0;
@@ -45,6 +45,8 @@ public:
     time_t              mDateCreated;
     time_t              mDateModified;
     char*               mKeywords;
+    // mName and the dates as written to a packet, if the database has them
+    UInt8List           mEncodedStrings;
 
 public:
                         MtpObjectInfo(MtpObjectHandle handle);
@@ -39,6 +39,8 @@ public:
 #endif
 
     inline MtpResponseCode      getResponseCode() const { return getContainerCode(); }
+    inline int                  getParameterCount() const
+                { return (mPacketSize - MTP_CONTAINER_HEADER_SIZE) / sizeof(uint32_t); }
     inline void                 setResponseCode(MtpResponseCode code)
                                                      { return setContainerCode(code); }
 };
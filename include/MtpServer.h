@@ -70,6 +70,8 @@ private:
     size_t              mSendObjectFileSize;
 
     MtpMutex               mMutex;
+    // events may be sent from the database's threads
+    MtpMutex               mEventMutex;
 
     // represents an MTP object that is being edited using the android extensions
     // for direct editing (BeginEditObject, SendPartialObject, TruncateObject and EndEditObject)
@@ -92,6 +94,19 @@ private:
     };
     Vector<ObjectEdit*>  mObjectEditList;
 
+    // a query and its answer, replayed as long as the database is unchanged
+    class CachedResponse {
+        public:
+        MtpOperationCode    mOperation;
+        UInt32List          mParameters;
+        UInt32List          mResponseParameters;
+        UInt8List           mData;
+    };
+    // least recently used first, all from mResponseCacheGeneration
+    Vector<CachedResponse>  mResponseCache;
+    uint64_t            mResponseCacheGeneration;
+    size_t              mResponseCacheBytes;
+
 public:
                         MtpServer(int fd, MtpDatabase* database, bool ptp,
                                     int fileGroup, int filePerm, int directoryPerm);
@@ -108,6 +123,7 @@ public:
     void                sendObjectRemoved(MtpObjectHandle handle);
     void                sendDevicePropertyChanged(MtpDeviceProperty property);
     void                sendObjectUpdated(MtpObjectHandle handle);
+    void                sendObjectInfoChanged(MtpObjectHandle handle);
 
 private:
     MtpStorage*         getStorageLocked(MtpStorageID id);
@@ -127,6 +143,11 @@ private:
     void                removeEditObject(MtpObjectHandle handle);
     void                commitEdit(ObjectEdit* edit);
 
+    bool                isCacheable(MtpOperationCode operation);
+    bool                replayResponse(MtpOperationCode operation, uint64_t generation);
+    void                cacheResponse(MtpOperationCode operation, uint64_t generation);
+    void                clearResponseCache();
+
     bool                handleRequest();
 
     MtpResponseCode     doGetDeviceInfo();
@@ -22,6 +22,9 @@
 // Max Character number of a MTP String
 #define MTP_STRING_MAX_CHARACTER_NUMBER             255
 
+// Max size of a MTP String in a packet: length, UTF-16 characters and terminator
+#define MTP_STRING_MAX_ENCODED_SIZE                 (1 + (MTP_STRING_MAX_CHARACTER_NUMBER + 1) * 2)
+
 namespace android {
 
 class MtpDataPacket;
@@ -48,6 +51,8 @@ public:
 
     bool            readFromPacket(MtpDataPacket* packet);
     void            writeToPacket(MtpDataPacket* packet) const;
+    // writes the string as it appears in a packet, returns its size
+    int             encode(uint8_t* dest) const;
 
     inline int      getCharCount() const { return mCharCount; }
     inline int      getByteCount() const { return mByteCount; }
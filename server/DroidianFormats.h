@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DROIDIAN_FORMATS_H_
+#define DROIDIAN_FORMATS_H_
+
+#include <mtp.h>
+#include <MtpTypes.h>
+
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace android
+{
+/* Tells the MTP object format of a file, from its extension or, for
+ * files that have none, from the first bytes of its contents.
+ *
+ * Extensions are looked up with a switch over a hash of the lowercased
+ * extension, computed at compile time for the case labels. The compiler
+ * rejects two extensions with the same hash, so the table stays a
+ * perfect hash as it grows, and a lookup is one hash and one string
+ * comparison, without allocating.
+ */
+class FormatClassifier
+{
+private:
+    // longest extension in the table
+    static const size_t kMaxExtension = 5;
+    // bytes read from a file's contents
+    static const size_t kSniffBytes = 16;
+
+    static constexpr char lower(char c)
+    {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    // FNV-1a
+    static constexpr uint32_t hash(const char* s, uint32_t h = 2166136261u)
+    {
+        return *s ? hash(s + 1, (h ^ static_cast<unsigned char>(*s)) * 16777619u) : h;
+    }
+
+    static MtpObjectFormat lookup(const char* key)
+    {
+#define EXTENSION_FORMAT(extension, format) \
+        case hash(extension): return std::strcmp(key, extension) == 0 ? format : MTP_FORMAT_UNDEFINED;
+
+        switch (hash(key)) {
+            EXTENSION_FORMAT("txt", MTP_FORMAT_TEXT)
+            EXTENSION_FORMAT("htm", MTP_FORMAT_HTML)
+            EXTENSION_FORMAT("html", MTP_FORMAT_HTML)
+            EXTENSION_FORMAT("aif", MTP_FORMAT_AIFF)
+            EXTENSION_FORMAT("aifc", MTP_FORMAT_AIFF)
+            EXTENSION_FORMAT("aiff", MTP_FORMAT_AIFF)
+            EXTENSION_FORMAT("wav", MTP_FORMAT_WAV)
+            EXTENSION_FORMAT("mp3", MTP_FORMAT_MP3)
+            EXTENSION_FORMAT("avi", MTP_FORMAT_AVI)
+            EXTENSION_FORMAT("mpe", MTP_FORMAT_MPEG)
+            EXTENSION_FORMAT("mpeg", MTP_FORMAT_MPEG)
+            EXTENSION_FORMAT("mpg", MTP_FORMAT_MPEG)
+            EXTENSION_FORMAT("asf", MTP_FORMAT_ASF)
+
+            EXTENSION_FORMAT("heic", MTP_FORMAT_DEFINED)
+            EXTENSION_FORMAT("heif", MTP_FORMAT_DEFINED)
+            EXTENSION_FORMAT("avif", MTP_FORMAT_DEFINED)
+            EXTENSION_FORMAT("webp", MTP_FORMAT_DEFINED)
+            EXTENSION_FORMAT("jpe", MTP_FORMAT_EXIF_JPEG)
+            EXTENSION_FORMAT("jpeg", MTP_FORMAT_EXIF_JPEG)
+            EXTENSION_FORMAT("jpg", MTP_FORMAT_EXIF_JPEG)
+            EXTENSION_FORMAT("fpx", MTP_FORMAT_FLASHPIX)
+            EXTENSION_FORMAT("bmp", MTP_FORMAT_BMP)
+            EXTENSION_FORMAT("crw", MTP_FORMAT_CIFF)
+            EXTENSION_FORMAT("gif", MTP_FORMAT_GIF)
+            EXTENSION_FORMAT("jfif", MTP_FORMAT_JFIF)
+            EXTENSION_FORMAT("pct", MTP_FORMAT_PICT)
+            EXTENSION_FORMAT("pict", MTP_FORMAT_PICT)
+            EXTENSION_FORMAT("png", MTP_FORMAT_PNG)
+            EXTENSION_FORMAT("tif", MTP_FORMAT_TIFF)
+            EXTENSION_FORMAT("tiff", MTP_FORMAT_TIFF)
+            EXTENSION_FORMAT("jp2", MTP_FORMAT_JP2)
+            EXTENSION_FORMAT("jpf", MTP_FORMAT_JPX)
+            EXTENSION_FORMAT("jpx", MTP_FORMAT_JPX)
+            EXTENSION_FORMAT("dng", MTP_FORMAT_DNG)
+
+            EXTENSION_FORMAT("wma", MTP_FORMAT_WMA)
+            EXTENSION_FORMAT("oga", MTP_FORMAT_OGG)
+            EXTENSION_FORMAT("ogg", MTP_FORMAT_OGG)
+            EXTENSION_FORMAT("opus", MTP_FORMAT_OGG)
+            EXTENSION_FORMAT("aac", MTP_FORMAT_AAC)
+            EXTENSION_FORMAT("aa", MTP_FORMAT_AUDIBLE)
+            EXTENSION_FORMAT("aax", MTP_FORMAT_AUDIBLE)
+            EXTENSION_FORMAT("flac", MTP_FORMAT_FLAC)
+
+            EXTENSION_FORMAT("mkv", MTP_FORMAT_UNDEFINED_VIDEO)
+            EXTENSION_FORMAT("mov", MTP_FORMAT_UNDEFINED_VIDEO)
+            EXTENSION_FORMAT("webm", MTP_FORMAT_UNDEFINED_VIDEO)
+            EXTENSION_FORMAT("wmv", MTP_FORMAT_WMV)
+            EXTENSION_FORMAT("m4a", MTP_FORMAT_MP4_CONTAINER)
+            EXTENSION_FORMAT("m4v", MTP_FORMAT_MP4_CONTAINER)
+            EXTENSION_FORMAT("mp4", MTP_FORMAT_MP4_CONTAINER)
+            EXTENSION_FORMAT("mp2", MTP_FORMAT_MP2)
+            EXTENSION_FORMAT("3g2", MTP_FORMAT_3GP_CONTAINER)
+            EXTENSION_FORMAT("3gp", MTP_FORMAT_3GP_CONTAINER)
+            EXTENSION_FORMAT("3gpp", MTP_FORMAT_3GP_CONTAINER)
+
+            EXTENSION_FORMAT("wpl", MTP_FORMAT_WPL_PLAYLIST)
+            EXTENSION_FORMAT("m3u", MTP_FORMAT_M3U_PLAYLIST)
+            EXTENSION_FORMAT("m3u8", MTP_FORMAT_M3U_PLAYLIST)
+            EXTENSION_FORMAT("mpl", MTP_FORMAT_MPL_PLAYLIST)
+            EXTENSION_FORMAT("asx", MTP_FORMAT_ASX_PLAYLIST)
+            EXTENSION_FORMAT("pls", MTP_FORMAT_PLS_PLAYLIST)
+
+            EXTENSION_FORMAT("pdf", MTP_FORMAT_UNDEFINED_DOCUMENT)
+            EXTENSION_FORMAT("xml", MTP_FORMAT_XML_DOCUMENT)
+            EXTENSION_FORMAT("doc", MTP_FORMAT_MS_WORD_DOCUMENT)
+            EXTENSION_FORMAT("docx", MTP_FORMAT_MS_WORD_DOCUMENT)
+            EXTENSION_FORMAT("mht", MTP_FORMAT_MHT_COMPILED_HTML_DOCUMENT)
+            EXTENSION_FORMAT("mhtml", MTP_FORMAT_MHT_COMPILED_HTML_DOCUMENT)
+            EXTENSION_FORMAT("xls", MTP_FORMAT_MS_EXCEL_SPREADSHEET)
+            EXTENSION_FORMAT("xlsx", MTP_FORMAT_MS_EXCEL_SPREADSHEET)
+            EXTENSION_FORMAT("ppt", MTP_FORMAT_MS_POWERPOINT_PRESENTATION)
+            EXTENSION_FORMAT("pptx", MTP_FORMAT_MS_POWERPOINT_PRESENTATION)
+
+            EXTENSION_FORMAT("vcf", MTP_FORMAT_VCARD_2)
+
+            default: return MTP_FORMAT_UNDEFINED;
+        }
+#undef EXTENSION_FORMAT
+    }
+
+    static bool starts_with(const unsigned char* data, size_t length, size_t offset, const char* magic, size_t size)
+    {
+        return offset + size <= length && std::memcmp(data + offset, magic, size) == 0;
+    }
+
+public:
+    // position of the extension's dot in a file name, npos if there is none
+    static size_t extension(const std::string& name)
+    {
+        size_t dot = name.rfind('.');
+
+        // a leading dot hides a file, it doesn't start an extension
+        if (dot == std::string::npos || dot == 0 || dot + 1 == name.size())
+            return std::string::npos;
+
+        return dot;
+    }
+
+    static MtpObjectFormat from_name(const std::string& name)
+    {
+        size_t dot = extension(name);
+        char key[kMaxExtension + 1];
+        size_t length;
+
+        if (dot == std::string::npos)
+            return MTP_FORMAT_UNDEFINED;
+
+        length = name.size() - dot - 1;
+        if (length > kMaxExtension)
+            return MTP_FORMAT_UNDEFINED;
+
+        for (size_t i = 0; i < length; i++)
+            key[i] = lower(name[dot + 1 + i]);
+        key[length] = '\0';
+
+        return lookup(key);
+    }
+
+    // whether a file's format is only known from its contents
+    static bool needs_sniff(const std::string& name)
+    {
+        return extension(name) == std::string::npos;
+    }
+
+    // format by the signature at the start of a file, undefined if none matches
+    static MtpObjectFormat from_contents(const std::string& path)
+    {
+        unsigned char data[kSniffBytes];
+        ssize_t length;
+        int fd;
+
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+        if (fd < 0)
+            return MTP_FORMAT_UNDEFINED;
+        length = read(fd, data, sizeof(data));
+        close(fd);
+
+        return length > 0 ? from_bytes(data, length) : MTP_FORMAT_UNDEFINED;
+    }
+
+    static MtpObjectFormat from_bytes(const unsigned char* data, size_t length)
+    {
+        if (starts_with(data, length, 0, "\xFF\xD8\xFF", 3))
+            return MTP_FORMAT_EXIF_JPEG;
+        if (starts_with(data, length, 0, "\x89PNG\r\n\x1A\n", 8))
+            return MTP_FORMAT_PNG;
+        if (starts_with(data, length, 0, "GIF87a", 6) || starts_with(data, length, 0, "GIF89a", 6))
+            return MTP_FORMAT_GIF;
+        if (starts_with(data, length, 0, "II*\0", 4) || starts_with(data, length, 0, "MM\0*", 4))
+            return MTP_FORMAT_TIFF;
+        if (starts_with(data, length, 0, "\0\0\0\x0CjP  ", 8))
+            return MTP_FORMAT_JP2;
+        if (starts_with(data, length, 0, "BM", 2) && starts_with(data, length, 6, "\0\0\0\0", 4))
+            return MTP_FORMAT_BMP;
+
+        if (starts_with(data, length, 0, "RIFF", 4)) {
+            if (starts_with(data, length, 8, "WAVE", 4))
+                return MTP_FORMAT_WAV;
+            if (starts_with(data, length, 8, "AVI ", 4))
+                return MTP_FORMAT_AVI;
+            if (starts_with(data, length, 8, "WEBP", 4))
+                return MTP_FORMAT_DEFINED;
+        }
+        if (starts_with(data, length, 0, "FORM", 4)
+                && (starts_with(data, length, 8, "AIFF", 4) || starts_with(data, length, 8, "AIFC", 4)))
+            return MTP_FORMAT_AIFF;
+
+        if (starts_with(data, length, 4, "ftyp", 4)) {
+            if (starts_with(data, length, 8, "3g", 2))
+                return MTP_FORMAT_3GP_CONTAINER;
+            if (starts_with(data, length, 8, "heic", 4) || starts_with(data, length, 8, "mif1", 4)
+                    || starts_with(data, length, 8, "avif", 4))
+                return MTP_FORMAT_DEFINED;
+            if (starts_with(data, length, 8, "qt  ", 4))
+                return MTP_FORMAT_UNDEFINED_VIDEO;
+            return MTP_FORMAT_MP4_CONTAINER;
+        }
+        if (starts_with(data, length, 0, "\x1A\x45\xDF\xA3", 4))
+            return MTP_FORMAT_UNDEFINED_VIDEO;
+        if (starts_with(data, length, 0, "\x30\x26\xB2\x75\x8E\x66\xCF\x11", 8))
+            return MTP_FORMAT_ASF;
+        if (starts_with(data, length, 0, "\0\0\x01\xBA", 4) || starts_with(data, length, 0, "\0\0\x01\xB3", 4))
+            return MTP_FORMAT_MPEG;
+
+        if (starts_with(data, length, 0, "OggS", 4))
+            return MTP_FORMAT_OGG;
+        if (starts_with(data, length, 0, "fLaC", 4))
+            return MTP_FORMAT_FLAC;
+        if (starts_with(data, length, 0, "ID3", 3))
+            return MTP_FORMAT_MP3;
+        // MPEG audio frame sync: ADTS is AAC, layer III is MP3
+        if (length >= 2 && data[0] == 0xFF && (data[1] & 0xF6) == 0xF0)
+            return MTP_FORMAT_AAC;
+        if (length >= 2 && data[0] == 0xFF && (data[1] & 0xE6) == 0xE2)
+            return MTP_FORMAT_MP3;
+
+        if (starts_with(data, length, 0, "%PDF-", 5))
+            return MTP_FORMAT_UNDEFINED_DOCUMENT;
+        if (starts_with(data, length, 0, "<?xml", 5))
+            return MTP_FORMAT_XML_DOCUMENT;
+        if (starts_with(data, length, 0, "BEGIN:VCARD", 11))
+            return MTP_FORMAT_VCARD_2;
+        if (starts_with(data, length, 0, "#EXTM3U", 7))
+            return MTP_FORMAT_M3U_PLAYLIST;
+        if (starts_with(data, length, 0, "[playlist]", 10))
+            return MTP_FORMAT_PLS_PLAYLIST;
+
+        return MTP_FORMAT_UNDEFINED;
+    }
+};
+}
+
+#endif // DROIDIAN_FORMATS_H_
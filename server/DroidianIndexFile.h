@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DROIDIAN_INDEX_FILE_H_
+#define DROIDIAN_INDEX_FILE_H_
+
+#include <MtpTypes.h>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+namespace android
+{
+/* On-disk copy of the object tree of one storage, read back through
+ * mmap when the daemon starts so that the storage doesn't have to be
+ * walked again.
+ *
+ * The file holds a header, the root directory's path, one fixed-size
+ * record per object in pre-order and the names of all objects. Each
+ * record refers to its parent by index; the first one is the storage's
+ * directory itself. Handles aren't kept, they are handed out again on
+ * load. Files from another version, another storage or a different
+ * file system mounted at the same path are ignored.
+ */
+class IndexFile
+{
+public:
+    struct Record
+    {
+        uint32_t parent;
+        uint32_t name_offset;
+        uint32_t name_length;
+        uint32_t flags;
+        uint64_t size;
+        int64_t last_modified;
+        int64_t date_created;
+    };
+
+    static const uint32_t kDirectory = 1;
+    // a directory whose entries weren't read yet, see lazy indexing
+    static const uint32_t kUnlisted = 2;
+
+private:
+    static const uint32_t kVersion = 1;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t storage_id;
+        uint64_t device;
+        uint64_t inode;
+        int64_t saved_at;
+        uint64_t count;
+        uint64_t names_size;
+        uint32_t root_length;
+        uint32_t reserved;
+    };
+
+    void* map;
+    size_t length;
+    const Header* header;
+    const Record* records;
+    const char* names;
+
+    static const char* magic() { return "MTPINDEX"; }
+
+    static size_t root_space(size_t length)
+    {
+        // keep the records 8-byte aligned
+        return (length + 7) & ~static_cast<size_t>(7);
+    }
+
+    bool check(MtpStorageID storage, const std::string& root, const struct stat& st)
+    {
+        size_t records_offset;
+
+        header = static_cast<const Header*>(map);
+        if (length < sizeof(Header)
+                || memcmp(header->magic, magic(), sizeof(header->magic)) != 0
+                || header->version != kVersion
+                || header->storage_id != storage
+                || header->device != static_cast<uint64_t>(st.st_dev)
+                || header->inode != static_cast<uint64_t>(st.st_ino))
+            return false;
+
+        records_offset = sizeof(Header) + root_space(header->root_length);
+        if (header->count == 0
+                || header->count > UINT32_MAX
+                || header->root_length > length
+                || records_offset > length
+                || header->count > (length - records_offset) / sizeof(Record)
+                || header->names_size != length - records_offset - header->count * sizeof(Record))
+            return false;
+
+        if (root.compare(0, std::string::npos,
+                         reinterpret_cast<const char*>(header + 1),
+                         header->root_length) != 0)
+            return false;
+
+        records = reinterpret_cast<const Record*>(static_cast<const char*>(map) + records_offset);
+        names = reinterpret_cast<const char*>(records + header->count);
+
+        // check everything loading relies on up front
+        for (uint64_t i = 0; i < header->count; i++) {
+            const Record& r = records[i];
+
+            if (r.name_offset > header->names_size
+                    || r.name_length > header->names_size - r.name_offset)
+                return false;
+
+            if (i == 0) {
+                if (!(r.flags & kDirectory))
+                    return false;
+            } else if (r.parent >= i
+                       || !(records[r.parent].flags & kDirectory)
+                       || r.name_length == 0
+                       || memchr(names + r.name_offset, '/', r.name_length))
+                return false;
+        }
+
+        return true;
+    }
+
+public:
+    IndexFile() :
+        map(MAP_FAILED),
+        length(0),
+        header(nullptr),
+        records(nullptr),
+        names(nullptr)
+    {
+    }
+
+    ~IndexFile()
+    {
+        if (map != MAP_FAILED)
+            munmap(map, length);
+    }
+
+    IndexFile(const IndexFile&) = delete;
+    IndexFile& operator=(const IndexFile&) = delete;
+
+    // maps file and checks that it describes root on storage
+    bool open(const std::string& file, MtpStorageID storage, const std::string& root)
+    {
+        struct stat st;
+        struct stat root_st;
+        int fd;
+
+        if (stat(root.c_str(), &root_st) != 0)
+            return false;
+
+        fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            length = st.st_size;
+            map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+
+        if (map == MAP_FAILED)
+            return false;
+
+        if (!check(storage, root, root_st)) {
+            LOG(WARNING) << "Ignoring stale or damaged index " << file;
+            return false;
+        }
+
+        return true;
+    }
+
+    size_t size() const { return header->count; }
+    std::time_t saved_at() const { return header->saved_at; }
+    const Record& record(size_t i) const { return records[i]; }
+
+    std::string name(const Record& r) const
+    {
+        return std::string(names + r.name_offset, r.name_length);
+    }
+
+    // writes a new index for root, replacing the old one in one go
+    static bool write(const std::string& file,
+                      MtpStorageID storage,
+                      const std::string& root,
+                      const std::vector<Record>& records,
+                      const std::string& names)
+    {
+        std::string temp = file + ".tmp";
+        std::vector<char> padding(root_space(root.size()) - root.size(), 0);
+        struct stat st;
+        Header header;
+        FILE* out;
+        bool ok;
+
+        if (records.empty() || stat(root.c_str(), &st) != 0)
+            return false;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic(), sizeof(header.magic));
+        header.version = kVersion;
+        header.storage_id = storage;
+        header.device = st.st_dev;
+        header.inode = st.st_ino;
+        header.saved_at = std::time(nullptr);
+        header.count = records.size();
+        header.names_size = names.size();
+        header.root_length = root.size();
+
+        out = fopen(temp.c_str(), "we");
+        if (!out) {
+            PLOG(WARNING) << "Could not write index " << temp;
+            return false;
+        }
+
+        ok = fwrite(&header, sizeof(header), 1, out) == 1
+            && fwrite(root.data(), 1, root.size(), out) == root.size()
+            && fwrite(padding.data(), 1, padding.size(), out) == padding.size()
+            && fwrite(records.data(), sizeof(Record), records.size(), out) == records.size()
+            && fwrite(names.data(), 1, names.size(), out) == names.size();
+        ok = fclose(out) == 0 && ok;
+
+        if (!ok || rename(temp.c_str(), file.c_str()) != 0) {
+            PLOG(WARNING) << "Could not write index " << file;
+            unlink(temp.c_str());
+            return false;
+        }
+
+        return true;
+    }
+};
+}
+
+#endif // DROIDIAN_INDEX_FILE_H_
@@ -26,21 +26,37 @@
 #include <MtpProperty.h>
 #include <MtpDebug.h>
 
+#include "DroidianFormats.h"
+#include "DroidianIndexFile.h"
+#include "DroidianObjectStore.h"
+#include "DroidianScanner.h"
+#include "DroidianWatcher.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
 #include <vector>
 #include <string>
 #include <tuple>
 #include <exception>
-#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <boost/thread.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/assign/list_of.hpp>
 #include <boost/foreach.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/range/adaptors.hpp>
@@ -58,310 +74,2143 @@ namespace android
 {
 class DroidianMtpDatabase : public android::MtpDatabase {
 private:
-    struct DbEntry
-    {
-        MtpStorageID storage_id;
-        MtpObjectFormat object_format;
-        MtpObjectHandle parent;
-        uint64_t object_size;
-        std::string display_name;
-        std::string path;
-        int watch_fd;
-        std::time_t last_modified;
-    };
+    std::atomic<MtpServer*> local_server;
+    std::mutex event_lock;
 
-    MtpServer* local_server;
-    uint32_t counter;
-    std::map<MtpObjectHandle, DbEntry> db;
-    std::map<std::string, MtpObjectFormat> formats = boost::assign::map_list_of
-        (".gif", MTP_FORMAT_GIF)
-        (".png", MTP_FORMAT_PNG)
-        (".jpeg", MTP_FORMAT_JFIF)
-        (".tiff", MTP_FORMAT_TIFF)
-        (".ogg", MTP_FORMAT_OGG)
-        (".mp3", MTP_FORMAT_MP3)
-        (".wav", MTP_FORMAT_WAV)
-        (".wma", MTP_FORMAT_WMA)
-        (".aac", MTP_FORMAT_AAC)
-        (".flac", MTP_FORMAT_FLAC);
-
-    boost::thread notifier_thread;
     boost::thread io_service_thread;
 
     asio::io_service io_svc;
     asio::io_service::work work;
-    asio::posix::stream_descriptor stream_desc;
-    asio::streambuf buf;
-    int inotify_fd;
+    std::unique_ptr<Watcher> watcher;
+
+    /* File system events are gathered for a short while and applied
+     * together, one change per name, so a burst of events costs a single
+     * update. Only touched from the io_service thread.
+     */
+    struct PendingEvent
+    {
+        // the directory, see WatchEvent
+        int wd;
+        std::string directory;
+        std::string name;
+        // all events seen for the name
+        uint32_t mask;
+        // whether the last of them was a deletion
+        bool deleted;
+        // a rename or move of name to to_name in the to_ directory, which
+        // is unset if the object left the tree
+        bool move;
+        int to_wd;
+        std::string to_directory;
+        std::string to_name;
+        uint32_t cookie;
+        // a move still unpaired when its window closed, see flush_events
+        bool held;
+
+        explicit PendingEvent(const WatchEvent& event) :
+            wd(event.wd), directory(event.directory), name(event.name),
+            mask(0), deleted(false), move(false), to_wd(-1),
+            cookie(event.cookie), held(false)
+        {
+        }
+    };
+
+    typedef std::tuple<int, std::string, std::string> PendingKey;
+
+    static const long kDebounceMillis = 200;
+
+    std::vector<PendingEvent> pending_events;
+    std::map<PendingKey, size_t> pending_index;
+    // moves waiting for their IN_MOVED_TO, by cookie
+    std::map<uint32_t, size_t> pending_moves;
+    // watches the kernel dropped, because the directory went away or its file system did
+    std::vector<int> lost_watches;
+    // events were dropped by the kernel, nothing can be trusted
+    bool overflowed;
+    asio::deadline_timer debounce;
+    bool debounce_armed;
+
+    /* Directories that couldn't be watched, typically because the user's
+     * max_user_watches ran out, are kept in their shard's unwatched set.
+     * They are looked at every now and then and reread when they changed.
+     */
+    static const long kPollSeconds = 30;
+    // mtimes this recent may hide another change in the same second
+    static const std::time_t kRecentSeconds = 2;
+
+    asio::deadline_timer poll_timer;
+    std::atomic<bool> watch_warned;
+
+    /* Paths the server is changing on disk itself, see beginPathMutation.
+     * The database is updated directly, so events for them and anything
+     * below them are dropped as they come in. The path itself is kept a
+     * little after the change is done, its last events may still be on
+     * the way.
+     */
+    struct Mutation
+    {
+        // changes still going on
+        unsigned active;
+        std::chrono::steady_clock::time_point expires;
+
+        Mutation() : active(0) {}
+    };
+
+    static const long kMutationGraceMillis = 500;
+
+    std::map<std::string, Mutation> mutations;
+    std::mutex mutation_lock;
+
+    /* Storages on file systems whose changes may not be reported, like
+     * FUSE mounts or FAT cards on some kernels. Their directories are
+     * checked against the disk when a session opens and every
+     * resync_interval seconds.
+     */
+    static const long kFuseMagic = 0x65735546;
+    static const long kMsdosMagic = 0x4d44;
+    static const long kExfatMagic = 0x2011bab0;
+
+    long resync_interval;
+    asio::deadline_timer resync_timer;
+
+    /* In lazy mode a directory is only read, and watched, once the host
+     * asks about it. A crawler thread reads the remaining ones in the
+     * background, breadth first; directories the host is browsing are
+     * moved to the front of its queue. Removable storages are always
+     * indexed this way, so plugging in a large card doesn't hold up the
+     * daemon. The crawler commits what it read every kCrawlBatchMillis,
+     * the host sees the storage fill in as it goes.
+     */
+    static const long kCrawlBatchMillis = 50;
+
+    bool lazy;
+    std::list<MtpObjectHandle> crawl_queue;
+    // where each directory is in the queue, so it is only queued once
+    std::map<MtpObjectHandle, std::list<MtpObjectHandle>::iterator> crawl_queued;
+    std::mutex crawl_lock;
+    std::condition_variable crawl_wakeup;
+    bool crawl_stop;
+    boost::thread crawler_thread;
+
+    /* Files without an extension get their format from their first bytes,
+     * read when the host first asks rather than while indexing. What was
+     * found is queued here for store_formats, so readers don't have to
+     * wait for a writer.
+     */
+    std::vector<std::pair<MtpObjectHandle, MtpObjectFormat> > sniffed_formats;
+    // files left undefined by a query, read by store_formats
+    std::set<MtpObjectHandle> unsniffed_files;
+    std::mutex sniff_lock;
+
+    /* The database is split into one shard per storage, each with its own
+     * object table, writer and range of handles, so that indexing or
+     * dropping a storage doesn't hold up requests about any other one.
+     * The top bits of a handle name its shard. Shard ids are handed out
+     * round robin, a storage that goes away doesn't have its handles
+     * reused by the next one.
+     */
+    static const unsigned kShardShift = ObjectStore::kHandleBits;
+    static const size_t kShards = 1 << (32 - kShardShift);
+    // storage ID of the requests that are about every storage
+    static const MtpStorageID kAllStorages = 0xFFFFFFFF;
+
+    struct Shard : public std::enable_shared_from_this<Shard>
+    {
+        const MtpStorageID storage;
+        const uint32_t id;
+        // absolute path of the storage's directory
+        const std::string root;
+        // current version of the object table, see Transaction
+        std::shared_ptr<const ObjectStore> published;
+        std::mutex write_lock;
+        // changes may go unreported, read before taking the write lock by
+        // resync_unreliable
+        std::atomic<bool> unreliable;
+
+        // the rest is only touched with the write lock held
+        MtpObjectHandle counter;
+        DirectoryScanner scanner;
+        // directories that couldn't be watched, see poll_unwatched
+        std::set<MtpObjectHandle> unwatched;
+        // known objects the host is sending again, see beginSendObject
+        std::set<MtpObjectHandle> resent;
+        // indexed in the background, see crawl
+        bool background;
+        // removed from the database, nothing new is watched for it
+        bool dropped;
+
+        Shard(DroidianMtpDatabase& database, MtpStorageID storage, uint32_t id, const std::string& root) :
+            storage(storage),
+            id(id),
+            root(root),
+            published(std::make_shared<ObjectStore>(id << kShardShift)),
+            unreliable(false),
+            counter(1),
+            scanner(boost::bind(&DroidianMtpDatabase::setup_dir_watch,
+                                &database,
+                                boost::ref(*this),
+                                boost::placeholders::_1)),
+            background(false),
+            dropped(false)
+        {
+        }
+
+        std::shared_ptr<const ObjectStore> snapshot() const
+        {
+            return std::atomic_load(&published);
+        }
+    };
+
+    struct ShardTable
+    {
+        std::shared_ptr<Shard> ids[kShards];
+        std::map<MtpStorageID, std::shared_ptr<Shard> > storages;
+    };
+
+    // replaced as a whole when a storage comes or goes
+    std::shared_ptr<const ShardTable> shards;
+    std::mutex shard_lock;
+    uint32_t last_shard;
+    // empty object table, for handles of no shard
+    std::shared_ptr<const ObjectStore> nothing;
+    // bumped after every commit that changed something and every storage
+    // change, see getGeneration
+    std::atomic<uint64_t> generation;
+
+    // watch descriptor -> shard of the watched directory, to route events
+    std::map<int, std::weak_ptr<Shard> > watch_shards;
+    std::mutex watch_lock;
+
+    /* Changes to the object table of a shard are made on a private copy
+     * of its published snapshot and become visible all at once on commit,
+     * so readers never wait for or see a half-done update. Writers of a
+     * shard are serialized; the events for what they changed are sent
+     * after the new snapshot is out, in commit order.
+     */
+    class Transaction
+    {
+    private:
+        DroidianMtpDatabase& database;
+        std::shared_ptr<Shard> owner;
+        std::unique_lock<std::mutex> lock;
+        std::shared_ptr<ObjectStore> store;
+        std::vector<std::pair<MtpEventCode, MtpObjectHandle> > events;
+
+    public:
+        Transaction(DroidianMtpDatabase& database, const std::shared_ptr<Shard>& shard) :
+            database(database),
+            owner(shard),
+            lock(shard->write_lock),
+            store(std::make_shared<ObjectStore>(*shard->snapshot()))
+        {
+        }
+
+        ObjectStore& db() { return *store; }
+        Shard& shard() { return *owner; }
+
+        /* Handles are counted up; once all of them were handed out, the
+         * count goes on in the ranges whose objects are all gone by now.
+         */
+        MtpObjectHandle next_handle()
+        {
+            MtpObjectHandle low = owner->counter;
+
+            if (low > ObjectStore::kHandleMask
+                    || (low % ObjectStore::kPageHandles == 0 && store->free_range(low) != low)) {
+                low = store->free_range(low & ObjectStore::kHandleMask);
+                if (low == 0)
+                    throw std::overflow_error("storage ran out of object handles");
+            }
+
+            owner->counter = low + 1;
+            return owner->id << kShardShift | low;
+        }
+
+        void notify(MtpEventCode code, MtpObjectHandle handle)
+        {
+            events.push_back(std::make_pair(code, handle));
+        }
+
+        void commit()
+        {
+            std::unique_lock<std::mutex> ordered(database.event_lock);
+            MtpServer* server = database.local_server;
+
+            // a transaction that changed nothing leaves cached replies valid
+            if (store->modified()) {
+                std::atomic_store(&owner->published,
+                                  std::shared_ptr<const ObjectStore>(store));
+                database.generation++;
+            }
+            lock.unlock();
+
+            if (!server)
+                return;
+
+            for (size_t i = 0; i < events.size(); i++) {
+                switch (events[i].first) {
+                    case MTP_EVENT_OBJECT_ADDED: server->sendObjectAdded(events[i].second); break;
+                    case MTP_EVENT_OBJECT_REMOVED: server->sendObjectRemoved(events[i].second); break;
+                    case MTP_EVENT_OBJECT_INFO_CHANGED: server->sendObjectInfoChanged(events[i].second); break;
+                    default: break;
+                }
+            }
+        }
+    };
+
+    std::shared_ptr<const ShardTable> shard_table() const
+    {
+        return std::atomic_load(&shards);
+    }
+
+    // shard a handle belongs to, null if there is none
+    std::shared_ptr<Shard> find_shard(MtpObjectHandle handle) const
+    {
+        return shard_table()->ids[handle >> kShardShift];
+    }
+
+    std::shared_ptr<Shard> storage_shard(MtpStorageID storage) const
+    {
+        std::shared_ptr<const ShardTable> table = shard_table();
+        std::map<MtpStorageID, std::shared_ptr<Shard> >::const_iterator it;
+
+        it = table->storages.find(storage);
+        return it == table->storages.end() ? nullptr : it->second;
+    }
+
+    std::vector<std::shared_ptr<Shard> > all_shards() const
+    {
+        std::shared_ptr<const ShardTable> table = shard_table();
+        std::vector<std::shared_ptr<Shard> > result;
+        std::map<MtpStorageID, std::shared_ptr<Shard> >::const_iterator it;
+
+        for (it = table->storages.begin(); it != table->storages.end(); ++it)
+            result.push_back(it->second);
+
+        return result;
+    }
+
+    // object table of the shard a handle belongs to
+    std::shared_ptr<const ObjectStore> snapshot(MtpObjectHandle handle) const
+    {
+        std::shared_ptr<Shard> shard = find_shard(handle);
+
+        return shard ? shard->snapshot() : nothing;
+    }
+
+    std::shared_ptr<Shard> add_shard(MtpStorageID storage, const std::string& root)
+    {
+        std::lock_guard<std::mutex> lock(shard_lock);
+        std::shared_ptr<ShardTable> updated = std::make_shared<ShardTable>(*shard_table());
+        std::shared_ptr<Shard> shard;
+
+        // neither 0 nor 0xFF, whose handles could be taken for special ones
+        for (size_t i = 0; i < kShards && !shard; i++) {
+            last_shard = last_shard % (kShards - 2) + 1;
+            if (!updated->ids[last_shard])
+                shard = std::make_shared<Shard>(*this, storage, last_shard, root);
+        }
+
+        if (!shard)
+            return nullptr;
+
+        updated->ids[shard->id] = shard;
+        updated->storages[storage] = shard;
+        std::atomic_store(&shards, std::shared_ptr<const ShardTable>(updated));
+        generation++;
+
+        return shard;
+    }
+
+    std::shared_ptr<Shard> drop_shard(MtpStorageID storage)
+    {
+        std::lock_guard<std::mutex> lock(shard_lock);
+        std::shared_ptr<ShardTable> updated = std::make_shared<ShardTable>(*shard_table());
+        std::map<MtpStorageID, std::shared_ptr<Shard> >::iterator it;
+        std::shared_ptr<Shard> shard;
+
+        it = updated->storages.find(storage);
+        if (it == updated->storages.end())
+            return nullptr;
+
+        shard = it->second;
+        updated->storages.erase(it);
+        updated->ids[shard->id].reset();
+        std::atomic_store(&shards, std::shared_ptr<const ShardTable>(updated));
+        generation++;
+
+        return shard;
+    }
+
+    // takes a file's format from its name, see object_format
+    void classify(ObjectStore& db, MtpObjectHandle handle)
+    {
+        std::string name = db.name(handle);
+
+        db.set_object_format(handle, FormatClassifier::from_name(name));
+        db.set_sniffed(handle, !FormatClassifier::needs_sniff(name));
+    }
+
+    /* Format of an object as told to the host. Files without an extension
+     * are only looked into the first time their format is asked for; the
+     * result is written back in the background by store_formats.
+     */
+    MtpObjectFormat object_format(const ObjectStore& db, MtpObjectHandle handle)
+    {
+        MtpObjectFormat format;
+
+        if (db.sniffed(handle))
+            return db.object_format(handle);
+
+        format = FormatClassifier::from_contents(db.path(handle));
+
+        std::lock_guard<std::mutex> lock(sniff_lock);
+        if (sniffed_formats.empty() && unsniffed_files.empty())
+            io_svc.post(boost::bind(&DroidianMtpDatabase::store_formats, this));
+        sniffed_formats.push_back(std::make_pair(handle, format));
+
+        return format;
+    }
+
+    /* Has the contents of files read in the background, for requests that
+     * go by the format index and take them as undefined until then.
+     */
+    void sniff_later(const std::vector<MtpObjectHandle>& handles)
+    {
+        if (handles.empty())
+            return;
+
+        std::lock_guard<std::mutex> lock(sniff_lock);
+        if (sniffed_formats.empty() && unsniffed_files.empty())
+            io_svc.post(boost::bind(&DroidianMtpDatabase::store_formats, this));
+        unsniffed_files.insert(handles.begin(), handles.end());
+    }
+
+    // a commit that changes a format moves on the generation, see Transaction
+    void store_formats()
+    {
+        std::vector<std::pair<MtpObjectHandle, MtpObjectFormat> > found;
+        std::map<std::shared_ptr<Shard>, std::vector<size_t> > by_shard;
+        std::set<MtpObjectHandle> unsniffed;
+
+        {
+            std::lock_guard<std::mutex> lock(sniff_lock);
+            found.swap(sniffed_formats);
+            unsniffed.swap(unsniffed_files);
+        }
+
+        BOOST_FOREACH(MtpObjectHandle i, unsniffed) {
+            std::shared_ptr<const ObjectStore> db = snapshot(i);
+
+            if (db->contains(i) && !db->sniffed(i))
+                found.push_back(std::make_pair(i, FormatClassifier::from_contents(db->path(i))));
+        }
+
+        for (size_t i = 0; i < found.size(); i++) {
+            if (std::shared_ptr<Shard> shard = find_shard(found[i].first))
+                by_shard[shard].push_back(i);
+        }
+
+        for (std::map<std::shared_ptr<Shard>, std::vector<size_t> >::iterator it = by_shard.begin();
+             it != by_shard.end();
+             ++it) {
+            Transaction tx(*this, it->first);
+            ObjectStore& db = tx.db();
+
+            BOOST_FOREACH(size_t i, it->second) {
+                MtpObjectHandle handle = found[i].first;
+
+                // gone since, or stored already
+                if (!db.contains(handle) || db.sniffed(handle))
+                    continue;
+
+                db.set_object_format(handle, found[i].second);
+                db.set_sniffed(handle, true);
+            }
+
+            tx.commit();
+        }
+    }
+
+    // called with the shard's write lock held, also from the scanner's workers
+    int setup_dir_watch(Shard& shard, path p)
+    {
+        int wd;
+
+        if (shard.dropped)
+            return Watcher::kNoWatch;
+
+        {
+            std::lock_guard<std::mutex> lock(watch_lock);
+
+            /* The same directory gets the same descriptor, which a
+             * dropped shard may still be about to release.
+             */
+            wd = watcher->add_directory(p.string());
+            if (Watcher::has_descriptor(wd))
+                watch_shards[wd] = shard.shared_from_this();
+        }
+
+        if (wd == Watcher::kNoWatch && errno == ENOSPC && !watch_warned.exchange(true))
+            PLOG(WARNING) << "Could not watch " << p << ", unwatched directories will be polled"
+                          << " (see fs.inotify.max_user_watches)";
+        else if (wd == Watcher::kNoWatch)
+            PLOG(WARNING) << "Could not watch " << p;
+
+        return wd;
+    }
+
+    // stops watching a directory, unless it is another shard's by now
+    void release_watch(Shard& shard, int wd)
+    {
+        std::lock_guard<std::mutex> lock(watch_lock);
+        std::map<int, std::weak_ptr<Shard> >::iterator it = watch_shards.find(wd);
 
-    MtpObjectFormat guess_object_format(std::string extension)
+        if (it == watch_shards.end() || it->second.lock().get() != &shard)
+            return;
+
+        watch_shards.erase(it);
+        watcher->remove_directory(wd);
+    }
+
+    // shard of the directory an event happened in
+    std::shared_ptr<Shard> route(int wd, const std::string& directory)
+    {
+        if (Watcher::has_descriptor(wd)) {
+            std::lock_guard<std::mutex> lock(watch_lock);
+            std::map<int, std::weak_ptr<Shard> >::iterator it = watch_shards.find(wd);
+
+            return it == watch_shards.end() ? nullptr : it->second.lock();
+        }
+
+        if (directory.empty())
+            return nullptr;
+
+        BOOST_FOREACH(const std::shared_ptr<Shard>& shard, all_shards()) {
+            if (directory.compare(0, shard->root.size(), shard->root) == 0
+                    && (directory.size() == shard->root.size() || directory[shard->root.size()] == '/'))
+                return shard;
+        }
+
+        return nullptr;
+    }
+
+    // remembers a directory whose watch couldn't be set up
+    void check_watch(Transaction& tx, MtpObjectHandle dir, int wd)
+    {
+        if (wd == Watcher::kNoWatch)
+            tx.shard().unwatched.insert(dir);
+    }
+
+    void drop_watch(Transaction& tx, MtpObjectHandle handle)
+    {
+        ObjectStore& db = tx.db();
+        int wd = db.watch_fd(handle);
+
+        if (db.object_format(handle) != MTP_FORMAT_ASSOCIATION || !Watcher::has_descriptor(wd))
+            return;
+
+        release_watch(tx.shard(), wd);
+        db.set_watch_fd(handle, Watcher::kNoWatch);
+    }
+
+    // handle the children of a directory are listed under
+    MtpObjectHandle child_parent(const ObjectStore& db, MtpObjectHandle dir)
+    {
+        /* Deal with the special case where the SD card might initially
+         * require an inotify watch, because it's not yet mounted.
+         * In this case, the SD card inotify watch is entered as a
+         * normal object, but the parent for the "real" directory
+         * for the mounted removable media should be the MTP root
+         * for the storage ID.
+         */
+        return db.parent(dir) == MTP_PARENT_ROOT ? 0 : dir;
+    }
+
+    // a listing of the object table it is in
+    typedef std::pair<std::shared_ptr<const ObjectStore>, const ObjectStore::HandleList*> Listing;
+
+    /* The listings under parent a request about storageID covers, a
+     * request about every storage is answered by each shard in turn.
+     */
+    std::vector<Listing> listings(MtpStorageID storageID, MtpObjectHandle parent)
+    {
+        std::vector<std::shared_ptr<Shard> > sources;
+        std::vector<Listing> result;
+
+        if (parent != 0) {
+            if (std::shared_ptr<Shard> shard = find_shard(parent))
+                sources.push_back(shard);
+        } else if (storageID == kAllStorages)
+            sources = all_shards();
+        else if (std::shared_ptr<Shard> shard = storage_shard(storageID))
+            sources.push_back(shard);
+
+        BOOST_FOREACH(const std::shared_ptr<Shard>& shard, sources) {
+            std::shared_ptr<const ObjectStore> db = shard->snapshot();
+            const ObjectStore::HandleList* children;
+
+            if (storageID != kAllStorages && storageID != shard->storage)
+                continue;
+
+            children = db->children_of(shard->storage, parent);
+            if (children)
+                result.push_back(Listing(db, children));
+        }
+
+        return result;
+    }
+
+    /* Every object of a format on the storages a request covers, looked
+     * up in the format index so that the cost follows the size of the
+     * result rather than of the storage. Files without an extension are
+     * filed as undefined until their contents were read, which is left
+     * to the background.
+     */
+    std::vector<MtpObjectHandle> objects_of_format(MtpStorageID storageID, MtpObjectFormat format)
+    {
+        std::vector<std::shared_ptr<Shard> > sources;
+        std::vector<MtpObjectHandle> result;
+
+        if (storageID == kAllStorages)
+            sources = all_shards();
+        else if (std::shared_ptr<Shard> shard = storage_shard(storageID))
+            sources.push_back(shard);
+
+        BOOST_FOREACH(const std::shared_ptr<Shard>& shard, sources) {
+            std::shared_ptr<const ObjectStore> db = shard->snapshot();
+            ObjectStore::HandleList found = db->with_format(shard->storage, format);
+            ObjectStore::HandleList undefined;
+            std::vector<MtpObjectHandle> unsniffed;
+            MtpObjectHandle root = db->root(shard->storage);
+
+            BOOST_FOREACH(MtpObjectHandle i, found) {
+                // the hidden top-level directory of a storage isn't shown
+                if (i != root || db->parent(i) != MTP_PARENT_ROOT)
+                    result.push_back(i);
+            }
+
+            if (format != MTP_FORMAT_UNDEFINED)
+                undefined = db->with_format(shard->storage, MTP_FORMAT_UNDEFINED);
+            BOOST_FOREACH(MtpObjectHandle i, format == MTP_FORMAT_UNDEFINED ? found : undefined) {
+                if (!db->sniffed(i))
+                    unsniffed.push_back(i);
+            }
+            sniff_later(unsniffed);
+        }
+
+        return result;
+    }
+
+    // objects of a format on a shard's storage, as objects_of_format finds them
+    size_t count_format(const Shard& shard, MtpObjectFormat format)
+    {
+        std::shared_ptr<const ObjectStore> db = shard.snapshot();
+        MtpObjectHandle root = db->root(shard.storage);
+        size_t result = db->count_format(shard.storage, format);
+
+        // the hidden top-level directory of a storage isn't shown
+        if (format == MTP_FORMAT_ASSOCIATION && root != 0 && db->parent(root) == MTP_PARENT_ROOT)
+            result--;
+
+        return result;
+    }
+
+    /* Objects of a format, 0 for any, in a shard's listing under parent.
+     * Answered from the counts the object table keeps, unless some files
+     * in the listing haven't been classified yet.
+     */
+    size_t count_listing(const Shard& shard, MtpStorageID storageID, MtpObjectHandle parent, MtpObjectFormat format)
+    {
+        std::shared_ptr<const ObjectStore> db = shard.snapshot();
+        const ObjectStore::HandleList* children;
+        size_t result = 0;
+
+        if (storageID != kAllStorages && storageID != shard.storage)
+            return 0;
+
+        if (format != 0 && db->unsniffed_children(shard.storage, parent) == 0)
+            return db->count_children(shard.storage, parent, format);
+
+        children = db->children_of(shard.storage, parent);
+        if (!children)
+            return 0;
+        if (format == 0)
+            return children->size();
+
+        BOOST_FOREACH(MtpObjectHandle i, *children) {
+            if (object_format(*db, i) == format)
+                result++;
+        }
+
+        return result;
+    }
+
+    /* Object properties the database reports, with their data type and
+     * the group a host can ask for them by in GetObjectPropList. Group 1
+     * is what it takes to show a file tree, group 2 the rest.
+     */
+    struct ObjectProperty
+    {
+        MtpObjectProperty code;
+        MtpDataType type;
+        uint32_t group;
+    };
+
+    static const std::vector<ObjectProperty>& object_properties()
+    {
+        static const std::vector<ObjectProperty> properties = {
+            {MTP_PROPERTY_STORAGE_ID, MTP_TYPE_UINT32, 1},
+            {MTP_PROPERTY_PARENT_OBJECT, MTP_TYPE_UINT32, 1},
+            {MTP_PROPERTY_OBJECT_FORMAT, MTP_TYPE_UINT16, 1},
+            {MTP_PROPERTY_OBJECT_SIZE, MTP_TYPE_UINT64, 1},
+            {MTP_PROPERTY_OBJECT_FILE_NAME, MTP_TYPE_STR, 1},
+            {MTP_PROPERTY_DISPLAY_NAME, MTP_TYPE_STR, 2},
+            {MTP_PROPERTY_PERSISTENT_UID, MTP_TYPE_UINT128, 1},
+            {MTP_PROPERTY_ASSOCIATION_TYPE, MTP_TYPE_UINT16, 1},
+            {MTP_PROPERTY_ASSOCIATION_DESC, MTP_TYPE_UINT32, 2},
+            {MTP_PROPERTY_PROTECTION_STATUS, MTP_TYPE_UINT16, 1},
+            {MTP_PROPERTY_DATE_CREATED, MTP_TYPE_STR, 1},
+            {MTP_PROPERTY_DATE_MODIFIED, MTP_TYPE_STR, 1},
+            {MTP_PROPERTY_HIDDEN, MTP_TYPE_UINT16, 2},
+            {MTP_PROPERTY_NON_CONSUMABLE, MTP_TYPE_UINT16, 2},
+        };
+
+        return properties;
+    }
+
+    static const ObjectProperty* find_object_property(MtpObjectProperty code)
+    {
+        BOOST_FOREACH(const ObjectProperty& property, object_properties()) {
+            if (property.code == code)
+                return &property;
+        }
+
+        return nullptr;
+    }
+
+    // most bytes the value of a property of an object takes in a packet
+    static size_t value_size(const ObjectStore& db, MtpObjectHandle handle, const ObjectProperty& property)
+    {
+        switch (property.type) {
+            case MTP_TYPE_UINT16: return 2;
+            case MTP_TYPE_UINT32: return 4;
+            case MTP_TYPE_UINT64: return 8;
+            case MTP_TYPE_UINT128: return 16;
+            default: break;
+        }
+
+        // dates are "YYYYMMDDThhmmss", see formatDateTime
+        size_t length = 15;
+
+        if (property.code == MTP_PROPERTY_OBJECT_FILE_NAME || property.code == MTP_PROPERTY_DISPLAY_NAME)
+            length = std::min<size_t>(db.name_length(handle), MTP_STRING_MAX_CHARACTER_NUMBER);
+
+        // length byte, UTF-16 characters and terminator
+        return 1 + 2 * (length + 1);
+    }
+
+    // writes the value of a property of an object whose format is known
+    static void put_property_value(MtpDataPacket& packet,
+                                   const ObjectStore& db,
+                                   MtpObjectHandle handle,
+                                   MtpObjectFormat format,
+                                   MtpObjectProperty property)
+    {
+        switch (property) {
+            case MTP_PROPERTY_STORAGE_ID: packet.putUInt32(db.storage_id(handle)); break;
+            case MTP_PROPERTY_PARENT_OBJECT: packet.putUInt32(db.parent(handle)); break;
+            case MTP_PROPERTY_OBJECT_FORMAT: packet.putUInt16(format); break;
+            case MTP_PROPERTY_OBJECT_SIZE: packet.putUInt64(db.object_size(handle)); break;
+            case MTP_PROPERTY_DISPLAY_NAME:
+            case MTP_PROPERTY_OBJECT_FILE_NAME: {
+                ObjectStore::EncodedStrings strings = db.encoded(handle);
+
+                packet.putBytes(strings.name(), strings.name_size());
+                break;
+            }
+            case MTP_PROPERTY_PERSISTENT_UID: packet.putUInt128(handle); break;
+            case MTP_PROPERTY_ASSOCIATION_TYPE:
+                if (format == MTP_FORMAT_ASSOCIATION)
+                    packet.putUInt16(MTP_ASSOCIATION_TYPE_GENERIC_FOLDER);
+                else
+                    packet.putUInt16(0);
+                break;
+            case MTP_PROPERTY_ASSOCIATION_DESC: packet.putUInt32(0); break;
+            case MTP_PROPERTY_PROTECTION_STATUS:
+                packet.putUInt16(0x0000); // no files are read-only for now.
+                break;
+            case MTP_PROPERTY_DATE_CREATED: {
+                ObjectStore::EncodedStrings strings = db.encoded(handle);
+
+                packet.putBytes(strings.date_created(), strings.date_created_size());
+                break;
+            }
+            case MTP_PROPERTY_DATE_MODIFIED: {
+                ObjectStore::EncodedStrings strings = db.encoded(handle);
+
+                packet.putBytes(strings.last_modified(), strings.last_modified_size());
+                break;
+            }
+            case MTP_PROPERTY_HIDDEN: packet.putUInt16(0); break;
+            case MTP_PROPERTY_NON_CONSUMABLE:
+                if (format == MTP_FORMAT_ASSOCIATION)
+                    packet.putUInt16(0); // folders are non-consumable
+                else
+                    packet.putUInt16(1); // files can usually be played.
+                break;
+            default: break;
+        }
+    }
+
+    // an object of a property list, along with the object table it is in
+    struct ListedObject
+    {
+        const ObjectStore* db;
+        MtpObjectHandle handle;
+        MtpObjectFormat format;
+
+        ListedObject(const ObjectStore* db, MtpObjectHandle handle) :
+            db(db), handle(handle), format(0) {}
+    };
+
+    /* The objects levels deep below dir, 0 for the storages' top level,
+     * in breadth first order. Directories the crawler hasn't read yet are
+     * moved to the front of its queue and left out for now.
+     */
+    void collect_subtree(MtpObjectHandle dir,
+                         uint32_t levels,
+                         std::vector<Listing>& pinned,
+                         std::vector<ListedObject>& objects)
     {
-        std::map<std::string, MtpObjectFormat>::iterator it;
+        size_t level_start = objects.size();
+
+        pinned = listings(kAllStorages, dir);
+        BOOST_FOREACH(const Listing& listing, pinned) {
+            BOOST_FOREACH(MtpObjectHandle i, *listing.second) {
+                objects.push_back(ListedObject(listing.first.get(), i));
+            }
+        }
+
+        for (uint32_t level = 1; level < levels; level++) {
+            size_t level_end = objects.size();
+
+            for (size_t n = level_start; n < level_end; n++) {
+                const ObjectStore& db = *objects[n].db;
+                MtpObjectHandle i = objects[n].handle;
+                const ObjectStore::HandleList* children;
+
+                if (db.object_format(i) != MTP_FORMAT_ASSOCIATION)
+                    continue;
+                if (!db.listed(i)) {
+                    prioritize(db, i);
+                    continue;
+                }
 
-        it = formats.find(extension);
-        if (it == formats.end()) {
-            boost::to_upper(extension);
-            it = formats.find(extension);
-            if (it == formats.end()) {
-                return MTP_FORMAT_UNDEFINED;
+                children = db.children_of(db.storage_id(i), child_parent(db, i));
+                if (!children)
+                    continue;
+                BOOST_FOREACH(MtpObjectHandle child, *children) {
+                    objects.push_back(ListedObject(&db, child));
+                }
             }
-	}
 
-	return it->second;
+            if (level_end == objects.size())
+                break;
+            level_start = level_end;
+        }
+    }
+
+    MtpObjectHandle find_child(const ObjectStore& db, MtpObjectHandle dir, const std::string& name)
+    {
+        return db.find_name(db.storage_id(dir), child_parent(db, dir), name);
+    }
+
+    /* Removes an object and everything below it, returns the number
+     * of entries that were dropped from the database.
+     */
+    size_t erase_entry(Transaction& tx, MtpObjectHandle handle)
+    {
+        ObjectStore& db = tx.db();
+        ObjectStore::HandleList descendants;
+        size_t erased = 1;
+
+        if (!db.contains(handle))
+            return 0;
+
+        drop_watch(tx, handle);
+
+        db.detach_children(db.storage_id(handle), handle, descendants);
+        BOOST_FOREACH(MtpObjectHandle i, descendants) {
+            erased += erase_entry(tx, i);
+        }
+
+        db.erase(handle);
+
+        return erased;
     }
 
-    int setup_dir_inotify(path p)
+    /* Adds a scanned file or tree to the database, handles in pre-order.
+     * Returns the handle of node.
+     */
+    MtpObjectHandle merge_scan(Transaction& tx,
+                               const ScanNode& node,
+                               MtpObjectHandle parent,
+                               MtpStorageID storage,
+                               bool announce = true)
     {
-        return inotify_add_watch(inotify_fd,
-                                 p.string().c_str(),
-                                 IN_MODIFY | IN_CREATE | IN_DELETE);
+        MtpObjectHandle handle = tx.next_handle();
+        DbEntry entry;
+
+        entry.storage_id = storage;
+        entry.parent = parent;
+        entry.display_name = node.name;
+        entry.object_size = node.size;
+        entry.watch_fd = node.watch_fd;
+        entry.last_modified = node.last_modified;
+        entry.date_created = node.date_created;
+
+        if (node.directory)
+            entry.object_format = MTP_FORMAT_ASSOCIATION;
+        else {
+            // see classify
+            entry.object_format = MTP_FORMAT_UNDEFINED;
+            VLOG(1) << "Adding \"" << node.name << "\"";
+        }
+
+        tx.db().insert(handle, entry);
+        if (!node.directory)
+            classify(tx.db(), handle);
+        if (announce)
+            tx.notify(MTP_EVENT_OBJECT_ADDED, handle);
+        // a directory left to the crawler is watched once it is listed
+        if (node.directory && !deferred(tx.shard()))
+            check_watch(tx, handle, node.watch_fd);
+
+        BOOST_FOREACH(const ScanNode& child, node.children) {
+            merge_scan(tx, child, handle, storage, announce);
+        }
+
+        return handle;
+    }
+
+    // whether the directories of a shard are left to the crawler
+    bool deferred(const Shard& shard) const
+    {
+        return lazy || shard.background;
+    }
+
+    void add_file_entry(Transaction& tx, path p, MtpObjectHandle parent, MtpStorageID storage)
+    {
+        ScanNode node;
+
+        if (!deferred(tx.shard())) {
+            if (tx.shard().scanner.scan(p, node))
+                merge_scan(tx, node, parent, storage);
+            return;
+        }
+
+        node.name = p.filename().string();
+        if (!DirectoryScanner::stat_entry(AT_FDCWD, p.c_str(), node))
+            return;
+
+        if (node.directory)
+            defer_listing(tx, merge_scan(tx, node, parent, storage));
+        else
+            merge_scan(tx, node, parent, storage);
+    }
+
+    /* Queues a directory for the crawler, at the front to have it read
+     * next. One that is queued already is moved instead. Called with the
+     * crawl lock held.
+     */
+    void queue_crawl(MtpObjectHandle dir, bool front)
+    {
+        std::map<MtpObjectHandle, std::list<MtpObjectHandle>::iterator>::iterator it;
+
+        it = crawl_queued.find(dir);
+        if (it != crawl_queued.end()) {
+            if (front)
+                crawl_queue.splice(crawl_queue.begin(), crawl_queue, it->second);
+            return;
+        }
+
+        crawl_queued[dir] = crawl_queue.insert(front ? crawl_queue.begin() : crawl_queue.end(), dir);
+    }
+
+    // leaves a directory to the crawler
+    void defer_listing(Transaction& tx, MtpObjectHandle dir)
+    {
+        std::lock_guard<std::mutex> lock(crawl_lock);
+
+        tx.db().set_listed(dir, false);
+        queue_crawl(dir, false);
+        crawl_wakeup.notify_one();
+    }
+
+    /* Reads a directory that was left unlisted. Its entries aren't new to
+     * the host, which hasn't seen the directory's contents yet, so they
+     * aren't announced.
+     */
+    void list_directory(Transaction& tx, MtpObjectHandle dir)
+    {
+        ObjectStore& db = tx.db();
+
+        if (!db.contains(dir) || db.listed(dir))
+            return;
+
+        // watch first, so nothing created while reading is missed
+        db.set_watch_fd(dir, setup_dir_watch(tx.shard(), db.path(dir)));
+        check_watch(tx, dir, db.watch_fd(dir));
+        db.set_listed(dir, true);
+        resync_directory(tx, dir, false);
+    }
+
+    /* The host is looking at dir: make sure it is listed and read its
+     * subdirectories next, as the host is likely to open one of them.
+     * Shards that aren't deferred have everything listed already.
+     */
+    void browse(MtpObjectHandle dir)
+    {
+        std::shared_ptr<Shard> shard = find_shard(dir);
+        std::shared_ptr<const ObjectStore> db;
+        const ObjectStore::HandleList* children;
+        std::vector<MtpObjectHandle> unlisted;
+
+        if (!shard || !deferred(*shard))
+            return;
+
+        db = shard->snapshot();
+        if (!db->contains(dir) || db->object_format(dir) != MTP_FORMAT_ASSOCIATION)
+            return;
+
+        if (!db->listed(dir)) {
+            try {
+                Transaction tx(*this, shard);
+
+                list_directory(tx, dir);
+                tx.commit();
+            } catch (const std::overflow_error& e) {
+                out_of_handles(shard, e);
+            }
+            db = shard->snapshot();
+        }
+
+        children = db->children_of(db->storage_id(dir), child_parent(*db, dir));
+        if (!children)
+            return;
+
+        for (ObjectStore::HandleList::const_reverse_iterator it = children->rbegin();
+             it != children->rend();
+             ++it) {
+            if (db->object_format(*it) == MTP_FORMAT_ASSOCIATION && !db->listed(*it))
+                unlisted.push_back(*it);
+        }
+
+        if (unlisted.empty())
+            return;
+
+        std::lock_guard<std::mutex> lock(crawl_lock);
+
+        BOOST_FOREACH(MtpObjectHandle i, unlisted) {
+            queue_crawl(i, true);
+        }
+
+        crawl_wakeup.notify_one();
+    }
+
+    // moves an unlisted directory to the front of the crawler's queue
+    void prioritize(const ObjectStore& db, MtpObjectHandle dir)
+    {
+        if (db.object_format(dir) != MTP_FORMAT_ASSOCIATION || db.listed(dir))
+            return;
+
+        std::lock_guard<std::mutex> lock(crawl_lock);
+
+        queue_crawl(dir, true);
+        crawl_wakeup.notify_one();
+    }
+
+    /* Takes the next directory off the crawler's queue, false to stop.
+     * Without waiting, only one of the given shard is taken.
+     */
+    bool next_crawl(MtpObjectHandle& dir, bool wait, uint32_t shard = 0)
+    {
+        std::unique_lock<std::mutex> lock(crawl_lock);
+
+        while (wait && !crawl_stop && crawl_queue.empty())
+            crawl_wakeup.wait(lock);
+        if (crawl_stop || crawl_queue.empty())
+            return false;
+        if (!wait && crawl_queue.front() >> kShardShift != shard)
+            return false;
+
+        dir = crawl_queue.front();
+        crawl_queued.erase(dir);
+        crawl_queue.pop_front();
+        return true;
+    }
+
+    void crawl()
+    {
+        MtpObjectHandle dir;
+
+        // stay out of the way of the host's requests
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+        while (next_crawl(dir, true)) {
+            long batch = kCrawlBatchMillis;
+            std::chrono::steady_clock::time_point deadline;
+            std::shared_ptr<Shard> shard = find_shard(dir);
+
+            if (!shard)
+                continue;
+
+            // the host may have had it listed already
+            std::shared_ptr<const ObjectStore> db = shard->snapshot();
+            if (!db->contains(dir) || db->listed(dir))
+                continue;
+
+            try {
+                Transaction tx(*this, shard);
+
+                deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(batch);
+                do {
+                    list_directory(tx, dir);
+                } while (std::chrono::steady_clock::now() < deadline
+                         && next_crawl(dir, false, shard->id));
+
+                tx.commit();
+            } catch (const std::overflow_error& e) {
+                out_of_handles(shard, e);
+            }
+        }
+    }
+
+    /* Brings the listing of a directory in line with the disk: objects
+     * that are gone are dropped, new ones scanned in and the size and
+     * times of files refreshed. Subdirectories that are still there
+     * aren't descended into.
+     */
+    bool resync_directory(Transaction& tx, MtpObjectHandle dir, bool announce = true)
+    {
+        ObjectStore& db = tx.db();
+        MtpStorageID storage = db.storage_id(dir);
+        MtpObjectHandle parent = child_parent(db, dir);
+        path p (db.path(dir));
+        ObjectStore::HandleList known;
+        std::vector<bool> seen;
+        ScanNode listing;
+        bool changed = false;
+
+        if (!DirectoryScanner::list(p, listing))
+            return false;
+
+        // the listing is now as recent as this
+        if (db.last_modified(dir) != listing.last_modified) {
+            db.set_last_modified(dir, listing.last_modified);
+            changed = true;
+        }
+
+        if (const ObjectStore::HandleList* children = db.children_of(storage, parent))
+            known = *children;
+        seen.resize(listing.children.size());
+
+        BOOST_FOREACH(MtpObjectHandle i, known) {
+            bool directory = db.object_format(i) == MTP_FORMAT_ASSOCIATION;
+            std::vector<ScanNode>::iterator it;
+            ScanNode key;
+
+            key.name = db.name(i);
+            it = std::lower_bound(listing.children.begin(), listing.children.end(), key);
+
+            if (it == listing.children.end() || it->name != key.name || it->directory != directory) {
+                VLOG(2) << "dropping vanished object " << (p / key.name).string();
+                erase_entry(tx, i);
+                if (announce)
+                    tx.notify(MTP_EVENT_OBJECT_REMOVED, i);
+                changed = true;
+                continue;
+            }
+
+            seen[it - listing.children.begin()] = true;
+
+            if (!directory
+                    && (db.object_size(i) != it->size
+                        || db.last_modified(i) != it->last_modified
+                        || db.date_created(i) != it->date_created)) {
+                db.set_object_size(i, it->size);
+                db.set_last_modified(i, it->last_modified);
+                db.set_date_created(i, it->date_created);
+                if (announce)
+                    tx.notify(MTP_EVENT_OBJECT_INFO_CHANGED, i);
+                changed = true;
+            }
+        }
+
+        for (size_t i = 0; i < listing.children.size(); i++) {
+            if (seen[i])
+                continue;
+
+            changed = true;
+            if (!listing.children[i].directory)
+                merge_scan(tx, listing.children[i], parent, storage, announce);
+            else if (deferred(tx.shard()))
+                defer_listing(tx, merge_scan(tx, listing.children[i], parent, storage, announce));
+            else
+                add_file_entry(tx, p / listing.children[i].name, parent, storage);
+        }
+
+        return changed;
+    }
+
+    /* Rereads the directories below dir whose modification time doesn't
+     * match the database, for when events went missing. Returns whether
+     * that changed anything.
+     */
+    bool resync_subtree(Transaction& tx, MtpObjectHandle dir)
+    {
+        ObjectStore& db = tx.db();
+        std::vector<MtpObjectHandle> pending(1, dir);
+        std::time_t recent = std::time(nullptr) - kRecentSeconds;
+        size_t checked = 0;
+        size_t reread = 0;
+        bool changed = false;
+
+        while (!pending.empty()) {
+            MtpObjectHandle current = pending.back();
+            const ObjectStore::HandleList* children;
+            struct stat st;
+
+            pending.pop_back();
+            if (!db.contains(current) || !db.listed(current))
+                continue;
+
+            // a directory that is gone is dropped by its parent's resync
+            checked++;
+            if (stat(db.path(current).c_str(), &st) != 0)
+                continue;
+
+            if (st.st_mtime != db.last_modified(current) || st.st_mtime >= recent) {
+                changed |= resync_directory(tx, current);
+                reread++;
+            }
+
+            children = db.children_of(db.storage_id(current), child_parent(db, current));
+            if (!children)
+                continue;
+
+            BOOST_FOREACH(MtpObjectHandle i, *children) {
+                if (db.object_format(i) == MTP_FORMAT_ASSOCIATION)
+                    pending.push_back(i);
+            }
+        }
+
+        VLOG(1) << "reread " << reread << " of " << checked << " directories";
+        return changed;
+    }
+
+    void poll_shard(const std::shared_ptr<Shard>& shard)
+    {
+        Transaction tx(*this, shard);
+        ObjectStore& db = tx.db();
+        std::set<MtpObjectHandle>& unwatched = shard->unwatched;
+        std::time_t recent = std::time(nullptr) - kRecentSeconds;
+        bool changed = false;
+
+        for (std::set<MtpObjectHandle>::iterator it = unwatched.begin(); it != unwatched.end(); ) {
+            MtpObjectHandle dir = *it;
+            struct stat st;
+            int wd;
+
+            if (!db.contains(dir) || Watcher::watched(db.watch_fd(dir))) {
+                unwatched.erase(it++);
+                continue;
+            }
+
+            // the crawler watches it when it gets there
+            if (!db.listed(dir) || stat(db.path(dir).c_str(), &st) != 0) {
+                ++it;
+                continue;
+            }
+
+            // watches may have been freed in the meantime
+            wd = setup_dir_watch(*shard, db.path(dir));
+            if (Watcher::watched(wd)) {
+                db.set_watch_fd(dir, wd);
+                unwatched.erase(it++);
+                changed = true;
+            } else
+                ++it;
+
+            if (Watcher::watched(wd) || st.st_mtime != db.last_modified(dir) || st.st_mtime >= recent) {
+                resync_directory(tx, dir);
+                changed = true;
+            }
+        }
+
+        if (changed)
+            tx.commit();
+    }
+
+    void poll_unwatched(const boost::system::error_code& error)
+    {
+        long interval = kPollSeconds;
+
+        if (error == asio::error::operation_aborted)
+            return;
+
+        BOOST_FOREACH(const std::shared_ptr<Shard>& shard, all_shards()) {
+            try {
+                poll_shard(shard);
+            } catch (const std::overflow_error& e) {
+                out_of_handles(shard, e);
+            }
+        }
+
+        poll_timer.expires_from_now(boost::posix_time::seconds(interval));
+        poll_timer.async_wait(boost::bind(&DroidianMtpDatabase::poll_unwatched,
+                                          this,
+                                          asio::placeholders::error));
+    }
+
+    // whether changes to the file system p is on may go unreported
+    static bool unreliable_events(const path& p)
+    {
+        struct statfs fs;
+
+        if (statfs(p.c_str(), &fs) != 0)
+            return false;
+
+        switch (fs.f_type) {
+            case kFuseMagic:
+            case kMsdosMagic:
+            case kExfatMagic:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // rereads the directories of unreliable storages that changed
+    void resync_unreliable()
+    {
+        BOOST_FOREACH(const std::shared_ptr<Shard>& shard, all_shards()) {
+            MtpObjectHandle root;
+
+            if (!shard->unreliable)
+                continue;
+
+            Transaction tx(*this, shard);
+
+            root = tx.db().root(shard->storage);
+            if (root == 0)
+                continue;
+
+            VLOG(1) << "checking " << shard->root << " for changes";
+            try {
+                if (resync_subtree(tx, root))
+                    tx.commit();
+            } catch (const std::overflow_error& e) {
+                LOG(ERROR) << "Could not index all of " << shard->root << ": " << e.what();
+            }
+        }
+    }
+
+    // rereads the directories of a shard that changed, as far as they fit
+    void resync_shard(const std::shared_ptr<Shard>& shard)
+    {
+        try {
+            Transaction tx(*this, shard);
+            MtpObjectHandle root = tx.db().root(shard->storage);
+
+            if (root != 0 && resync_subtree(tx, root))
+                tx.commit();
+        } catch (const std::overflow_error& e) {
+            LOG(ERROR) << "Could not index all of " << shard->root << ": " << e.what();
+        }
+    }
+
+    /* A change to a shard was dropped along with its transaction, because
+     * the shard ran out of handles: whatever still fits is read again.
+     */
+    void out_of_handles(const std::shared_ptr<Shard>& shard, const std::overflow_error& e)
+    {
+        LOG(ERROR) << "Dropped changes to " << shard->root << ": " << e.what();
+        io_svc.post(boost::bind(&DroidianMtpDatabase::resync_shard, this, shard));
+    }
+
+    void resync_storages(const boost::system::error_code& error)
+    {
+        long interval = resync_interval;
+
+        if (error == asio::error::operation_aborted)
+            return;
+
+        resync_unreliable();
+
+        resync_timer.expires_from_now(boost::posix_time::seconds(interval));
+        resync_timer.async_wait(boost::bind(&DroidianMtpDatabase::resync_storages,
+                                            this,
+                                            asio::placeholders::error));
+    }
+
+    // releases the watches of a removed storage's shard
+    void release_shard(const std::shared_ptr<Shard>& shard)
+    {
+        // after whoever is still changing it
+        std::lock_guard<std::mutex> lock(shard->write_lock);
+
+        shard->dropped = true;
+        BOOST_FOREACH(int wd, shard->snapshot()->watch_fds()) {
+            release_watch(*shard, wd);
+        }
+    }
+
+    // rereads directories of a shard, all in one transaction
+    void resync_later(const std::shared_ptr<Shard>& shard, const std::vector<MtpObjectHandle>& dirs)
+    {
+        try {
+            Transaction tx(*this, shard);
+
+            BOOST_FOREACH(MtpObjectHandle i, dirs) {
+                // unlisted directories are up to the crawler
+                if (tx.db().contains(i) && tx.db().listed(i))
+                    resync_directory(tx, i);
+            }
+
+            tx.commit();
+        } catch (const std::overflow_error& e) {
+            out_of_handles(shard, e);
+        }
+    }
+
+    std::string index_file(MtpStorageID storage)
+    {
+        const char* cache = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        char name[32];
+        path dir;
+
+        if (cache && *cache)
+            dir = path(cache) / "mtp-server";
+        else if (home && *home)
+            dir = path(home) / ".cache" / "mtp-server";
+        else
+            return std::string();
+
+        snprintf(name, sizeof(name), "%08x.index", storage);
+        return (dir / name).string();
+    }
+
+    /* Fills a storage in from its saved index instead of walking it.
+     * Every directory that changed since the index was written is read
+     * again afterwards in the background, the others are taken as they
+     * are.
+     */
+    bool load_index(Transaction& tx,
+                    const path& p,
+                    const std::string& display_name,
+                    MtpStorageID storage,
+                    bool hidden,
+                    MtpObjectHandle handle)
+    {
+        ObjectStore& db = tx.db();
+        std::vector<MtpObjectHandle> handles;
+        std::vector<MtpObjectHandle> stale;
+        std::vector<std::string> paths;
+        IndexFile index;
+
+        if (!index.open(index_file(storage), storage, p.string()))
+            return false;
+
+        VLOG(1) << "loading " << index.size() << " objects of " << p << " from the index";
+
+        handles.resize(index.size());
+        paths.resize(index.size());
+
+        for (size_t i = 0; i < index.size(); i++) {
+            const IndexFile::Record& r = index.record(i);
+            bool directory = r.flags & IndexFile::kDirectory;
+            bool unlisted = r.flags & IndexFile::kUnlisted;
+            struct stat st;
+            DbEntry entry;
+
+            entry.storage_id = storage;
+            entry.object_size = r.size;
+            entry.watch_fd = -1;
+            entry.last_modified = r.last_modified;
+            entry.date_created = r.date_created;
+
+            if (i == 0) {
+                handles[i] = handle;
+                paths[i] = p.string();
+                entry.parent = hidden ? MTP_PARENT_ROOT : 0;
+                entry.display_name = display_name;
+            } else {
+                handles[i] = tx.next_handle();
+                entry.parent = r.parent == 0 && hidden ? 0 : handles[r.parent];
+                entry.display_name = index.name(r);
+                if (directory)
+                    paths[i] = paths[r.parent] + "/" + entry.display_name;
+            }
+
+            if (directory) {
+                entry.object_format = MTP_FORMAT_ASSOCIATION;
+                if (!(deferred(tx.shard()) && unlisted))
+                    entry.watch_fd = setup_dir_watch(tx.shard(), paths[i]);
+            } else
+                entry.object_format = MTP_FORMAT_UNDEFINED;
+
+            db.insert(handles[i], entry);
+            if (!directory)
+                classify(db, handles[i]);
+            if (i == 0)
+                db.add_storage(storage, handle, p.string());
+            else
+                tx.notify(MTP_EVENT_OBJECT_ADDED, handles[i]);
+            if (directory && !(deferred(tx.shard()) && unlisted))
+                check_watch(tx, handles[i], entry.watch_fd);
+
+            /* mtimes have a resolution of a second, so a directory changed
+             * in the second the index was written may look unchanged.
+             */
+            if (directory && deferred(tx.shard()) && unlisted)
+                defer_listing(tx, handles[i]);
+            else if (directory
+                     && (unlisted
+                         || stat(paths[i].c_str(), &st) != 0
+                         || st.st_mtime != r.last_modified
+                         || st.st_mtime >= index.saved_at()))
+                stale.push_back(handles[i]);
+        }
+
+        VLOG(1) << stale.size() << " directories changed since the index was saved";
+
+        // runs once readFiles has committed the storage
+        if (!stale.empty())
+            io_svc.post(boost::bind(&DroidianMtpDatabase::resync_later,
+                                    this,
+                                    tx.shard().shared_from_this(),
+                                    stale));
+
+        return true;
+    }
+
+    void save_index(const ObjectStore& db, MtpStorageID storage)
+    {
+        std::vector<std::pair<MtpObjectHandle, uint32_t> > pending;
+        std::vector<IndexFile::Record> records;
+        std::string file = index_file(storage);
+        MtpObjectHandle root = db.root(storage);
+        boost::system::error_code ec;
+        std::string names;
+
+        if (file.empty() || root == 0)
+            return;
+
+        // depth first, so that every record comes after its parent
+        pending.push_back(std::make_pair(root, 0));
+        while (!pending.empty()) {
+            MtpObjectHandle handle = pending.back().first;
+            const ObjectStore::HandleList* children;
+            IndexFile::Record r;
+            // the storage's directory is named by the storage
+            std::string name = records.empty() ? std::string() : db.name(handle);
+
+            r.parent = pending.back().second;
+            r.name_offset = names.size();
+            r.name_length = name.size();
+            r.flags = db.object_format(handle) == MTP_FORMAT_ASSOCIATION ? IndexFile::kDirectory : 0;
+            if (!db.listed(handle))
+                r.flags |= IndexFile::kUnlisted;
+            r.size = db.object_size(handle);
+            r.last_modified = db.last_modified(handle);
+            r.date_created = db.date_created(handle);
+
+            pending.pop_back();
+            names += name;
+            records.push_back(r);
+
+            if (!(r.flags & IndexFile::kDirectory))
+                continue;
+
+            children = db.children_of(storage, child_parent(db, handle));
+            if (children) {
+                for (ObjectStore::HandleList::const_reverse_iterator it = children->rbegin();
+                     it != children->rend();
+                     ++it)
+                    pending.push_back(std::make_pair(*it, records.size() - 1));
+            }
+        }
+
+        create_directories(path(file).parent_path(), ec);
+        if (IndexFile::write(file, storage, db.root_path(storage), records, names))
+            VLOG(1) << "saved " << records.size() << " objects to " << file;
+    }
+
+    void save_indexes()
+    {
+        BOOST_FOREACH(const std::shared_ptr<Shard>& shard, all_shards()) {
+            save_index(*shard->snapshot(), shard->storage);
+        }
+    }
+
+    void readFiles(const std::string& sourcedir, const std::string& display, MtpStorageID storage, bool hidden)
+    {
+        path p (sourcedir);
+        std::shared_ptr<Shard> shard;
+	DbEntry entry;
+        std::string display_name = std::string(p.filename().string());
+
+        if (!display.empty())
+            display_name = display;
+
+        // the same storage may be added again without having been removed
+        removeStorage(storage);
+
+        shard = add_shard(storage, p.string());
+        if (!shard) {
+            LOG(ERROR) << "Too many storages, not adding " << p;
+            return;
+        }
+
+        Transaction tx(*this, shard);
+	MtpObjectHandle handle = tx.next_handle();
+
+        try {
+            if (exists(p)) {
+                if (!is_directory(p))
+                    LOG(WARNING) << p << " is not a directory.";
+                else {
+                    // set up before anything is read, like directory watches
+                    watcher->add_storage(p.string());
+                    if (unreliable_events(p)) {
+                        VLOG(1) << p << " may not report changes, it is checked regularly";
+                        shard->unreliable = true;
+                    }
+                    // removable storages, see crawl()
+                    shard->background = hidden;
+
+                    if (!load_index(tx, p, display_name, storage, hidden, handle)) {
+                        ScanNode root;
+
+                        if (deferred(*shard))
+                            DirectoryScanner::stat_entry(AT_FDCWD, p.c_str(), root);
+                        else
+                            shard->scanner.scan(p, root);
+
+                        entry.storage_id = storage;
+                        entry.parent = hidden ? MTP_PARENT_ROOT : 0;
+                        entry.display_name = display_name;
+                        entry.object_format = MTP_FORMAT_ASSOCIATION;
+                        entry.object_size = 0;
+                        entry.watch_fd = root.watch_fd;
+                        entry.last_modified = root.last_modified;
+                        entry.date_created = root.date_created;
+
+                        tx.db().insert(handle, entry);
+                        tx.db().add_storage(storage, handle, p.string());
+                        if (!deferred(*shard))
+                            check_watch(tx, handle, entry.watch_fd);
+
+                        if (deferred(*shard)) {
+                            // only the top level for now
+                            tx.db().set_listed(handle, false);
+                            list_directory(tx, handle);
+                        }
+
+                        BOOST_FOREACH(const ScanNode& child, root.children) {
+                            merge_scan(tx, child, hidden ? 0 : handle, storage);
+                        }
+                    }
+                }
+            } else
+                LOG(WARNING) << p << " does not exist.";
+        }
+        catch (const filesystem_error& ex) {
+            LOG(ERROR) << ex.what();
+        }
+        // what was read so far is kept
+        catch (const std::overflow_error& ex) {
+            LOG(ERROR) << "Could not index all of " << p << ": " << ex.what();
+        }
+
+        tx.commit();
+    }
+
+    // whether path, or a directory above it, is being changed by the server
+    bool mutating(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutation_lock);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        for (size_t end = path.size();
+             end > 0 && end != std::string::npos;
+             end = path.rfind('/', end - 1)) {
+            std::map<std::string, Mutation>::iterator it = mutations.find(path.substr(0, end));
+
+            if (it == mutations.end())
+                continue;
+            if (it->second.active > 0 || (end == path.size() && it->second.expires > now))
+                return true;
+            if (it->second.expires <= now)
+                mutations.erase(it);
+        }
+
+        return false;
+    }
+
+    // whether an event was caused by a change the server made itself
+    bool own_event(const WatchEvent& event)
+    {
+        std::string directory = event.directory;
+
+        {
+            std::lock_guard<std::mutex> lock(mutation_lock);
+
+            if (mutations.empty())
+                return false;
+        }
+
+        if (directory.empty()) {
+            std::shared_ptr<Shard> shard = route(event.wd, directory);
+            std::shared_ptr<const ObjectStore> db = shard ? shard->snapshot() : nothing;
+            MtpObjectHandle dir = db->find_watch(event.wd);
+
+            if (dir == 0)
+                return false;
+            directory = db->path(dir);
+        }
+
+        return mutating(directory + "/" + event.name);
+    }
+
+    // merges a batch of events from the watcher into the pending ones
+    void queue_events(const std::vector<WatchEvent>& events)
+    {
+        BOOST_FOREACH(const WatchEvent& ievent, events) {
+            std::map<PendingKey, size_t>::iterator it;
+
+            if (ievent.mask & IN_Q_OVERFLOW) {
+                LOG(WARNING) << "Missed file system events, checking all storages";
+                overflowed = true;
+                continue;
+            }
+
+            if (ievent.mask & (IN_IGNORED | IN_DELETE_SELF)) {
+                lost_watches.push_back(ievent.wd);
+                continue;
+            }
+
+            if (ievent.name.empty() || own_event(ievent))
+                continue;
+
+            /* Moves are kept in order with the other events; whatever
+             * happens to a name afterwards is merged into a new entry.
+             */
+            if (ievent.mask & IN_MOVED_FROM) {
+                PendingEvent event(ievent);
+
+                event.move = true;
+                pending_moves[ievent.cookie] = pending_events.size();
+                pending_events.push_back(event);
+                pending_index.clear();
+                continue;
+            }
+
+            uint32_t mask = ievent.mask;
+
+            if (mask & IN_MOVED_TO) {
+                std::map<uint32_t, size_t>::iterator from = pending_moves.find(ievent.cookie);
+
+                if (from != pending_moves.end()) {
+                    pending_events[from->second].to_wd = ievent.wd;
+                    pending_events[from->second].to_directory = ievent.directory;
+                    pending_events[from->second].to_name = ievent.name;
+                    pending_moves.erase(from);
+                    continue;
+                }
+
+                // moved in from outside the watched tree
+                mask = IN_CREATE;
+            }
+
+            if (!(mask & (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE)))
+                continue;
+
+            PendingKey key(ievent.wd, ievent.directory, ievent.name);
+
+            it = pending_index.find(key);
+            if (it == pending_index.end()) {
+                it = pending_index.insert(std::make_pair(key, pending_events.size())).first;
+                pending_events.push_back(PendingEvent(ievent));
+            }
+
+            PendingEvent& event = pending_events[it->second];
+
+            event.mask |= mask;
+            event.deleted = mask & IN_DELETE;
+        }
+
+        // the window opens with the first event and isn't extended
+        if ((!pending_events.empty() || !lost_watches.empty() || overflowed)
+                && !debounce_armed) {
+            long window = kDebounceMillis;
+
+            debounce_armed = true;
+            debounce.expires_from_now(boost::posix_time::milliseconds(window));
+            debounce.async_wait(boost::bind(&DroidianMtpDatabase::flush_events,
+                                            this,
+                                            asio::placeholders::error));
+        }
+    }
+
+    // handle of the directory at an absolute path, 0 if it isn't known
+    MtpObjectHandle find_directory(const ObjectStore& db, const std::string& dir)
+    {
+        BOOST_FOREACH(MtpStorageID storage, db.storages()) {
+            std::string root = db.root_path(storage);
+            MtpObjectHandle current = db.root(storage);
+            size_t start = root.size();
+
+            if (dir.compare(0, root.size(), root) != 0
+                    || (dir.size() > root.size() && dir[root.size()] != '/'))
+                continue;
+
+            while (current != 0 && start < dir.size()) {
+                size_t end = dir.find('/', start + 1);
+
+                if (end == std::string::npos)
+                    end = dir.size();
+                if (end > start + 1)
+                    current = find_child(db, current, dir.substr(start + 1, end - start - 1));
+                start = end;
+            }
+
+            return current;
+        }
+
+        return 0;
+    }
+
+    // directory an event happened in, 0 if it isn't known
+    MtpObjectHandle event_directory(const ObjectStore& db, int wd, const std::string& directory)
+    {
+        if (Watcher::has_descriptor(wd))
+            return db.find_watch(wd);
+        if (!directory.empty())
+            return find_directory(db, directory);
+        return 0;
+    }
+
+    // applies everything that happened to one name during the window
+    void apply_event(Transaction& tx, const PendingEvent& event)
+    {
+        ObjectStore& db = tx.db();
+        MtpObjectHandle parent;
+        MtpObjectHandle handle;
+        ScanNode node;
+        path p;
+
+        parent = event_directory(db, event.wd, event.directory);
+        if (parent == 0) {
+            VLOG(2) << "Ignoring event for unknown directory " << event.wd << " " << event.directory;
+            return;
+        }
+
+        // whatever is in there is picked up when it gets listed
+        if (!db.listed(parent))
+            return;
+
+        try {
+            p = path(db.path(parent) + "/" + event.name);
+        } catch (...) {
+            PLOG(WARNING) << "Could not find parent for event " << event.name;
+            return;
+        }
+
+        handle = find_child(db, parent, event.name);
+
+        /* A file deleted and created again within the window keeps its
+         * handle, which may be one the host just got from beginSendObject.
+         * A directory is replaced, its watch went away with the old one.
+         */
+        if (handle != 0
+                && (event.deleted
+                    || (event.mask & IN_DELETE && db.object_format(handle) == MTP_FORMAT_ASSOCIATION))) {
+            VLOG(2) << __PRETTY_FUNCTION__ << ": file deleted: " << p.string();
+            erase_entry(tx, handle);
+            tx.notify(MTP_EVENT_OBJECT_REMOVED, handle);
+            handle = 0;
+        }
+
+        if (event.deleted)
+            return;
+
+        if (handle == 0) {
+            VLOG(2) << __PRETTY_FUNCTION__ << ": file created: " << p.string();
+            add_file_entry(tx, p, child_parent(db, parent), db.storage_id(parent));
+        } else if (event.mask & IN_CLOSE_WRITE) {
+            /* Objects created through beginSendObject are already known
+             * (see bug #1351042), for them this is just a refresh.
+             */
+            VLOG(2) << __PRETTY_FUNCTION__ << ": file written: " << p.string();
+            if (DirectoryScanner::stat_entry(AT_FDCWD, p.c_str(), node) && !node.directory) {
+                VLOG(2) << "new size: " << node.size;
+                db.set_object_size(handle, node.size);
+                db.set_last_modified(handle, node.last_modified);
+                // its contents may tell another format now
+                if (FormatClassifier::needs_sniff(db.name(handle)))
+                    classify(db, handle);
+            }
+        }
     }
 
-
-    void add_file_entry(path p, MtpObjectHandle parent, MtpStorageID storage)
+    /* Follows a rename or move on disk: the object keeps its handle and
+     * its subtree stays where it is, only its parent and name change.
+     */
+    void apply_move(Transaction& tx, const PendingEvent& event)
     {
-        MtpObjectHandle handle = counter;
-        DbEntry entry;
+        ObjectStore& db = tx.db();
+        MtpObjectHandle from = event_directory(db, event.wd, event.directory);
+        MtpObjectHandle to = event_directory(db, event.to_wd, event.to_directory);
+        MtpObjectHandle handle = from == 0 ? 0 : find_child(db, from, event.name);
+        MtpObjectHandle existing;
+
+        // moved out of the watched tree, or to another storage
+        if (handle != 0 && (to == 0 || db.storage_id(to) != db.storage_id(handle))) {
+            VLOG(2) << __PRETTY_FUNCTION__ << ": " << event.name << " moved away";
+            erase_entry(tx, handle);
+            tx.notify(MTP_EVENT_OBJECT_REMOVED, handle);
+            handle = 0;
+        }
 
-        counter++;
+        if (to == 0)
+            return;
 
-        if (is_directory(p)) {
-            entry.storage_id = storage;
-            entry.parent = parent;
-            entry.display_name = std::string(p.filename().string());
-            entry.path = p.string();
-            entry.object_format = MTP_FORMAT_ASSOCIATION;
-            entry.object_size = 0;
-            entry.watch_fd = setup_dir_inotify(p);
-            entry.last_modified = last_write_time(p);
+        /* Not known at the source, either because the database was
+         * updated first (MoveObject, renaming through MTP) or because it
+         * was never seen: treat it as created at the destination.
+         */
+        if (handle == 0) {
+            WatchEvent target;
 
-            db.insert( std::pair<MtpObjectHandle, DbEntry>(handle, entry) );
+            target.wd = event.to_wd;
+            target.directory = event.to_directory;
+            target.name = event.to_name;
 
-            if (local_server)
-                local_server->sendObjectAdded(handle);
+            PendingEvent created(target);
 
-            parse_directory (p, handle, storage);
-        } else {
-            try {
-                entry.storage_id = storage;
-                entry.parent = parent;
-                entry.display_name = std::string(p.filename().string());
-                entry.path = p.string();
-                entry.object_format = guess_object_format(p.extension().string());
-                entry.object_size = file_size(p);
-                entry.last_modified = last_write_time(p);
+            created.mask = IN_CREATE;
+            apply_event(tx, created);
+            return;
+        }
 
-                VLOG(1) << "Adding \"" << p.string() << "\"";
+        existing = find_child(db, to, event.to_name);
+        if (existing == handle)
+            return;
 
-                db.insert( std::pair<MtpObjectHandle, DbEntry>(handle, entry) );
+        // the move replaced what was at the destination
+        if (existing != 0) {
+            erase_entry(tx, existing);
+            tx.notify(MTP_EVENT_OBJECT_REMOVED, existing);
+        }
 
-                if (local_server)
-                    local_server->sendObjectAdded(handle);
+        VLOG(2) << __PRETTY_FUNCTION__ << ": " << event.name << " -> "
+                << db.path(to) << "/" << event.to_name;
 
-            } catch (const filesystem_error& ex) {
-                PLOG(WARNING) << "There was an error reading file properties";
-            }
+        if (child_parent(db, to) != db.parent(handle))
+            db.reparent(handle, child_parent(db, to));
+        if (event.to_name != event.name) {
+            db.rename(handle, event.to_name);
+            if (db.object_format(handle) != MTP_FORMAT_ASSOCIATION)
+                classify(db, handle);
         }
+
+        tx.notify(MTP_EVENT_OBJECT_INFO_CHANGED, handle);
     }
 
-    void parse_directory(path p, MtpObjectHandle parent, MtpStorageID storage)
+    // what happened to a shard during the window
+    struct ShardEvents
     {
-	DbEntry entry;
-        std::vector<path> v;
-        boost::system::error_code ec;
-        directory_iterator i (p, ec);
+        std::vector<const PendingEvent*> events;
+        std::vector<int> lost_watches;
+    };
 
-        if (ec == boost::system::errc::permission_denied) {
-            VLOG(2) << "Could not immediately read dir; retrying.";
-            boost::this_thread::sleep(boost::posix_time::millisec(500));
-            i = directory_iterator(p);
-        }
+    /* Hands the events over to the shards they are about, each of which
+     * applies its own in one transaction. An object moved from one
+     * storage to another leaves the first and is created in the second.
+     */
+    void flush_events(const boost::system::error_code& error)
+    {
+        std::map<std::shared_ptr<Shard>, ShardEvents> batches;
+        std::map<std::shared_ptr<Shard>, ShardEvents>::iterator it;
 
-        copy(i, directory_iterator(), std::back_inserter(v));
+        debounce_armed = false;
 
-        for (std::vector<path>::const_iterator it(v.begin()), it_end(v.end()); it != it_end; ++it)
-        {
-            add_file_entry(*it, parent, storage);
-        }
-    }
+        if (error == asio::error::operation_aborted)
+            return;
 
-    void readFiles(const std::string& sourcedir, const std::string& display, MtpStorageID storage, bool hidden)
-    {
-        path p (sourcedir);
-	DbEntry entry;
-	MtpObjectHandle handle = counter++;
-        std::string display_name = std::string(p.filename().string());
+        /* The two halves of a move may be read in different windows. The
+         * first move still waiting for its other half is given one more
+         * window, along with everything after it to keep the order.
+         */
+        std::vector<PendingEvent> later;
+        size_t ready = 0;
 
-        if (!display.empty())
-            display_name = display;
+        while (ready < pending_events.size() && !overflowed) {
+            const PendingEvent& event = pending_events[ready];
 
-        try {
-            if (exists(p)) {
-                if (is_directory(p)) {
-                    entry.storage_id = storage;
-                    entry.parent = hidden ? MTP_PARENT_ROOT : 0;
-                    entry.display_name = display_name;
-                    entry.path = p.string();
-                    entry.object_format = MTP_FORMAT_ASSOCIATION;
-                    entry.object_size = 0;
-                    entry.watch_fd = setup_dir_inotify(p);
-                    entry.last_modified = last_write_time(p);
-
-                    db.insert( std::pair<MtpObjectHandle, DbEntry>(handle, entry) );
-
-                    parse_directory (p, hidden ? 0 : handle, storage);
-                } else
-                    LOG(WARNING) << p << " is not a directory.";
-            } else {
-                if (storage == MTP_STORAGE_FIXED_RAM)
-                    LOG(WARNING) << p << " does not exist.";
-                else {
-                    entry.storage_id = storage;
-                    entry.parent = -1;
-                    entry.display_name = display_name;
-                    entry.path = p.parent_path().string();
-                    entry.object_format = MTP_FORMAT_ASSOCIATION;
-                    entry.object_size = 0;
-                    entry.watch_fd = setup_dir_inotify(p.parent_path());
-                    entry.last_modified = 0;
-                }
-            }
-        }
-        catch (const filesystem_error& ex) {
-            LOG(ERROR) << ex.what();
+            if (event.move && event.to_name.empty() && !event.held)
+                break;
+            ready++;
         }
+        later.assign(pending_events.begin() + ready, pending_events.end());
+        pending_events.erase(pending_events.begin() + ready, pending_events.end());
 
-    }
+        VLOG(2) << "applying " << pending_events.size() << " coalesced events";
 
-    void read_more_notify()
-    {
-        stream_desc.async_read_some(buf.prepare(buf.max_size()),
-                                    boost::bind(&DroidianMtpDatabase::inotify_handler,
-                                                this,
-                                                asio::placeholders::error,
-                                                asio::placeholders::bytes_transferred));
-    }
+        BOOST_FOREACH(const PendingEvent& event, pending_events) {
+            std::shared_ptr<Shard> from = route(event.wd, event.directory);
+            std::shared_ptr<Shard> to = event.move ? route(event.to_wd, event.to_directory) : from;
 
-    void inotify_handler(const boost::system::error_code&,
-                        std::size_t transferred)
-    {
-        size_t processed = 0;
+            if (from)
+                batches[from].events.push_back(&event);
+            if (to && to != from)
+                batches[to].events.push_back(&event);
+        }
 
-        while(transferred - processed >= sizeof(inotify_event))
-        {
-            const char* cdata = processed + asio::buffer_cast<const char*>(buf.data());
-            const inotify_event* ievent = reinterpret_cast<const inotify_event*>(cdata);
-            MtpObjectHandle parent;
-            path p;
+        BOOST_FOREACH(int wd, lost_watches) {
+            std::shared_ptr<Shard> shard = route(wd, std::string());
 
-            processed += sizeof(inotify_event) + ievent->len;
+            if (shard)
+                batches[shard].lost_watches.push_back(wd);
 
-            BOOST_FOREACH(MtpObjectHandle i, db | boost::adaptors::map_keys) {
-                if (db.at(i).watch_fd == ievent->wd) {
-                    parent = i;
-                    break;
-                }
+            std::lock_guard<std::mutex> lock(watch_lock);
+            watch_shards.erase(wd);
+        }
+        lost_watches.clear();
+
+        if (overflowed) {
+            BOOST_FOREACH(const std::shared_ptr<Shard>& shard, all_shards()) {
+                batches[shard];
             }
+        }
 
+        for (it = batches.begin(); it != batches.end(); ++it) {
             try {
-                p = path(db.at(parent).path + "/" + ievent->name);
-            } catch (...) {
-                PLOG(WARNING) << "Could not find parent for event " << ievent->name;
-                continue;
-            }
+                Transaction tx(*this, it->first);
 
-            if(ievent->len > 0 && ievent->mask & IN_MODIFY)
-            {
-                VLOG(2) << __PRETTY_FUNCTION__ << ": file modified: " << p.string();
-                BOOST_FOREACH(MtpObjectHandle i, db | boost::adaptors::map_keys) {
-                    if (db.at(i).path == p.string()) {
-                        try {
-                            VLOG(2) << "new size: " << file_size(p);
-                            db.at(i).object_size = file_size(p);
-                        } catch (const filesystem_error& ex) {
-                            PLOG(WARNING) << "There was an error reading file properties";
-                        }
-                    }
+                BOOST_FOREACH(const PendingEvent* event, it->second.events) {
+                    if (event->move)
+                        apply_move(tx, *event);
+                    else
+                        apply_event(tx, *event);
                 }
-            }
-            else if(ievent->len > 0 && ievent->mask & IN_CREATE)
-            {
-                int parent_handle = parent;
-                bool exists = false;
-
-                VLOG(2) << __PRETTY_FUNCTION__ << ": file created: " << p.string();
-                BOOST_FOREACH(MtpObjectHandle i, db | boost::adaptors::map_keys) {
-                    if (db.at(i).path == p.string()) {
-			/* ignore files we already have (ie. from a beginSendObject)
-                         * See bug #1351042
-                         */
-                        exists = true;
-                        break;
+
+                /* A directory deleted along with its parent is gone from the
+                 * database by now; any other one lost its watch and is polled.
+                 */
+                BOOST_FOREACH(int wd, it->second.lost_watches) {
+                    MtpObjectHandle dir = tx.db().find_watch(wd);
+
+                    if (dir != 0) {
+                        VLOG(2) << "lost the watch on " << tx.db().path(dir);
+                        tx.db().set_watch_fd(dir, Watcher::kNoWatch);
+                        tx.shard().unwatched.insert(dir);
                     }
                 }
 
-                if (!exists) {
-                    /* Deal with the special case where the SD card might initially
-                     * require an inotify watch, because it's not yet mounted.
-                     * In this case, the SD card inotify watch is entered as a
-                     * normal object, but the parent for the "real" directory
-                     * for the mounted removable media should be the MTP root
-                     * for the storage ID.
-                     */
-                    if (db.at(parent).parent == MTP_PARENT_ROOT)
-                        parent_handle = 0;
-
-                    /* try to deal with it as if it was a file. */
-                    add_file_entry(p, parent_handle, db.at(parent).storage_id);
-                }
+                if (overflowed && tx.db().root(it->first->storage) != 0)
+                    resync_subtree(tx, tx.db().root(it->first->storage));
+
+                tx.commit();
+            } catch (const std::overflow_error& e) {
+                out_of_handles(it->first, e);
             }
-            else if(ievent->len > 0 && ievent->mask & IN_DELETE)
-            {
-                VLOG(2) << __PRETTY_FUNCTION__ << ": file deleted: " << p.string();
-                BOOST_FOREACH(MtpObjectHandle i, db | boost::adaptors::map_keys) {
-                    if (db.at(i).path == p.string()) {
-                        VLOG(2) << "deleting file at handle " << i;
-                        deleteFile(i);
-                        if (local_server)
-                            local_server->sendObjectRemoved(i);
-                        break;
-                    }
-                }
+        }
+
+        // a held move whose other half still hasn't arrived left the tree
+        pending_events.swap(later);
+        pending_index.clear();
+        pending_moves.clear();
+        overflowed = false;
+
+        for (size_t i = 0; i < pending_events.size(); i++) {
+            PendingEvent& event = pending_events[i];
+
+            if (event.move && event.to_name.empty()) {
+                event.held = true;
+                pending_moves[event.cookie] = i;
             }
         }
 
-        read_more_notify();
+        if (!pending_events.empty()) {
+            long window = kDebounceMillis;
+
+            debounce_armed = true;
+            debounce.expires_from_now(boost::posix_time::milliseconds(window));
+            debounce.async_wait(boost::bind(&DroidianMtpDatabase::flush_events,
+                                            this,
+                                            asio::placeholders::error));
+        }
     }
 
 public:
-    DroidianMtpDatabase():
-        counter(1),
-        stream_desc(io_svc),
+    explicit DroidianMtpDatabase(bool lazy = false, long resync_interval = 0):
+        local_server(nullptr),
         work(io_svc),
-        buf(1024)
+        watcher(Watcher::create(io_svc)),
+        overflowed(false),
+        debounce(io_svc),
+        debounce_armed(false),
+        poll_timer(io_svc),
+        watch_warned(false),
+        resync_interval(resync_interval),
+        resync_timer(io_svc),
+        lazy(lazy),
+        crawl_stop(false),
+        shards(std::make_shared<ShardTable>()),
+        last_shard(0),
+        nothing(std::make_shared<ObjectStore>()),
+        generation(1)
     {
-        local_server = nullptr;
-
-        inotify_fd = inotify_init();
-        if (inotify_fd <= 0)
-            PLOG(FATAL) << "Invalid file descriptor to inotify";
-        VLOG(1) << "using inotify fd " << inotify_fd << " for database";
-
-        stream_desc.assign(inotify_fd);
-
-	db = std::map<MtpObjectHandle, DbEntry>();
-
-        notifier_thread = boost::thread(&DroidianMtpDatabase::read_more_notify,
-                                       this);
+        watcher->start(boost::bind(&DroidianMtpDatabase::queue_events,
+                                   this,
+                                   boost::placeholders::_1));
+
+        // the first round finds nothing to do and schedules the next one
+        poll_timer.expires_from_now(boost::posix_time::seconds(0));
+        poll_timer.async_wait(boost::bind(&DroidianMtpDatabase::poll_unwatched,
+                                          this,
+                                          asio::placeholders::error));
+
+        if (resync_interval > 0) {
+            resync_timer.expires_from_now(boost::posix_time::seconds(resync_interval));
+            resync_timer.async_wait(boost::bind(&DroidianMtpDatabase::resync_storages,
+                                                this,
+                                                asio::placeholders::error));
+        }
 
         io_service_thread = boost::thread(boost::bind(&asio::io_service::run, &io_svc));
+        crawler_thread = boost::thread(&DroidianMtpDatabase::crawl, this);
     }
 
     virtual ~DroidianMtpDatabase() {
+        {
+            std::lock_guard<std::mutex> lock(crawl_lock);
+
+            crawl_stop = true;
+            crawl_wakeup.notify_all();
+        }
+        if (crawler_thread.joinable())
+            crawler_thread.join();
+
         io_svc.stop();
-        notifier_thread.detach();
         io_service_thread.join();
-        close(inotify_fd);
+
+        save_indexes();
     }
 
     virtual void addStoragePath(const MtpString& path,
@@ -374,11 +2223,14 @@ public:
 
     virtual void removeStorage(MtpStorageID storage)
     {
-        // remove all database entries corresponding to said storage.
-        BOOST_FOREACH(MtpObjectHandle i, db | boost::adaptors::map_keys) {
-            if (db.at(i).storage_id == storage)
-                db.erase(i);
-        }
+        // all of its objects are gone at once, its watches go in the background
+        std::shared_ptr<Shard> shard = drop_shard(storage);
+
+        if (!shard)
+            return;
+
+        watcher->remove_storage(shard->root);
+        io_svc.post(boost::bind(&DroidianMtpDatabase::release_shard, this, shard));
     }
 
     // called from SendObjectInfo to reserve a database entry for the incoming file
@@ -391,7 +2243,8 @@ public:
         time_t modified)
     {
 	DbEntry entry;
-	MtpObjectHandle handle = counter;
+        std::string name = std::string(basename(path.c_str()));
+        MtpObjectHandle existing;
 
         if (storage == MTP_STORAGE_FIXED_RAM && parent == 0)
             return kInvalidObjectHandle;
@@ -399,17 +2252,69 @@ public:
         VLOG(1) << __PRETTY_FUNCTION__ << ": " << path << " - " << parent
                 << " format: " << std::hex << format << std::dec;
 
+        std::shared_ptr<Shard> shard = storage_shard(storage);
+
+        if (!shard)
+            return kInvalidObjectHandle;
+
+        Transaction tx(*this, shard);
+        ObjectStore& db = tx.db();
+
+        /* The host is (re)sending an object we already know about; hand
+         * back the existing handle rather than listing the path twice.
+         */
+        existing = db.find_name(storage, parent, name);
+        if (existing != 0) {
+            if ((db.object_format(existing) == MTP_FORMAT_ASSOCIATION)
+                    != (format == MTP_FORMAT_ASSOCIATION)) {
+                LOG(WARNING) << path << " already exists as a different kind of object";
+                return kInvalidObjectHandle;
+            }
+
+            VLOG(1) << "reusing handle " << existing << " for " << path;
+
+            // not to be dropped if the transfer fails, see endSendObject
+            shard->resent.insert(existing);
+
+            if (format != MTP_FORMAT_ASSOCIATION) {
+                db.set_object_format(existing, format);
+                if (format == MTP_FORMAT_UNDEFINED)
+                    classify(db, existing);
+                else
+                    db.set_sniffed(existing, true);
+                db.set_object_size(existing, size);
+                db.set_last_modified(existing, modified);
+                tx.commit();
+            }
+
+            return existing;
+        }
+
+        MtpObjectHandle handle;
+
+        try {
+            handle = tx.next_handle();
+        } catch (const std::overflow_error& e) {
+            LOG(ERROR) << e.what();
+            return kInvalidObjectHandle;
+        }
+
         entry.storage_id = storage;
         entry.parent = parent;
-        entry.display_name = std::string(basename(path.c_str()));
-        entry.path = path;
+        entry.display_name = name;
         entry.object_format = format;
         entry.object_size = size;
+        entry.watch_fd = -1;
         entry.last_modified = modified;
+        // until the file exists and can be asked
+        entry.date_created = modified;
 
-        db.insert( std::pair<MtpObjectHandle, DbEntry>(handle, entry) );
+        db.insert(handle, entry);
+        // the host doesn't know better, maybe the name does
+        if (format == MTP_FORMAT_UNDEFINED)
+            classify(db, handle);
 
-	counter++;
+        tx.commit();
 
         return handle;
     }
@@ -425,18 +2330,58 @@ public:
     {
         VLOG(1) << __PRETTY_FUNCTION__ << ": " << path;
 
+        std::shared_ptr<Shard> shard = find_shard(handle);
+
+        if (!shard)
+            return;
+
         try
         {
-	    if (!succeeded) {
-                db.erase(handle);
+            Transaction tx(*this, shard);
+            bool resent = shard->resent.erase(handle) > 0;
+
+	    if (!succeeded && !resent) {
+                erase_entry(tx, handle);
+            } else if (!succeeded) {
+                ScanNode node;
+
+                // the object was there before, keep it as long as it still is
+                if (!DirectoryScanner::stat_entry(AT_FDCWD, path.c_str(), node)
+                        || !tx.db().contains(handle)
+                        || node.directory != (tx.db().object_format(handle) == MTP_FORMAT_ASSOCIATION)) {
+                    if (erase_entry(tx, handle) > 0)
+                        tx.notify(MTP_EVENT_OBJECT_REMOVED, handle);
+                } else if (!node.directory) {
+                    tx.db().set_object_size(handle, node.size);
+                    tx.db().set_last_modified(handle, node.last_modified);
+                    classify(tx.db(), handle);
+                }
             } else {
-                boost::filesystem::path p (path);
+                ScanNode node;
 
-                if (format != MTP_FORMAT_ASSOCIATION) {
+                if (DirectoryScanner::stat_entry(AT_FDCWD, path.c_str(), node)) {
                     /* Resync file size, just in case this is actually an Edit. */
-                    db.at(handle).object_size = file_size(p);
+                    if (format != MTP_FORMAT_ASSOCIATION)
+                        tx.db().set_object_size(handle, node.size);
+                    tx.db().set_date_created(handle, node.date_created);
+                    // anything sniffed before the data was in doesn't count
+                    if (format == MTP_FORMAT_UNDEFINED)
+                        classify(tx.db(), handle);
+                }
+
+                /* The event for the new directory is the server's own and
+                 * dropped, so watch it here; anything created in it before
+                 * that is picked up by reading it once.
+                 */
+                if (format == MTP_FORMAT_ASSOCIATION && tx.db().contains(handle)
+                        && tx.db().watch_fd(handle) == Watcher::kNoWatch) {
+                    tx.db().set_watch_fd(handle, setup_dir_watch(*shard, path));
+                    check_watch(tx, handle, tx.db().watch_fd(handle));
+                    resync_directory(tx, handle);
                 }
             }
+
+            tx.commit();
         } catch(...)
         {
             LOG(ERROR) << __PRETTY_FUNCTION__
@@ -444,25 +2389,65 @@ public:
         }
     }
 
+    virtual void beginPathMutation(const MtpString& path)
+    {
+        std::lock_guard<std::mutex> lock(mutation_lock);
+
+        mutations[path].active++;
+    }
+
+    virtual void endPathMutation(const MtpString& path)
+    {
+        std::lock_guard<std::mutex> lock(mutation_lock);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::map<std::string, Mutation>::iterator it = mutations.find(path);
+        long grace = kMutationGraceMillis;
+
+        if (it != mutations.end() && it->second.active > 0 && --it->second.active == 0)
+            it->second.expires = now + std::chrono::milliseconds(grace);
+
+        // forget about changes that are long done
+        for (it = mutations.begin(); it != mutations.end(); ) {
+            if (it->second.active == 0 && it->second.expires <= now)
+                mutations.erase(it++);
+            else
+                ++it;
+        }
+    }
+
     virtual MtpObjectHandleList* getObjectList(
         MtpStorageID storageID,
         MtpObjectFormat format,
         MtpObjectHandle parent)
     {
         VLOG(1) << __PRETTY_FUNCTION__ << ": " << storageID << ", " << format << ", " << parent;
-        MtpObjectHandleList* list = nullptr;
+
+        // parent 0 and a format ask for all objects of the format, at any depth
+        bool anywhere = parent == 0 && format != 0;
 
         if (parent == MTP_PARENT_ROOT)
             parent = 0;
+        else
+            browse(parent);
+
+        MtpObjectHandleList* list = nullptr;
 
         try
         {
             std::vector<MtpObjectHandle> keys;
 
-            BOOST_FOREACH(MtpObjectHandle i, db | boost::adaptors::map_keys) {
-                if (db.at(i).storage_id == storageID && db.at(i).parent == parent)
-                    if (format == 0 || db.at(i).object_format == format)
-                        keys.push_back(i);
+            if (anywhere)
+                return new MtpObjectHandleList(objects_of_format(storageID, format));
+
+            BOOST_FOREACH(const Listing& listing, listings(storageID, parent)) {
+                if (format == 0)
+                    keys.insert(keys.end(), listing.second->begin(), listing.second->end());
+                else {
+                    BOOST_FOREACH(MtpObjectHandle i, *listing.second) {
+                        if (object_format(*listing.first, i) == format)
+                            keys.push_back(i);
+                    }
+                }
             }
 
             list = new MtpObjectHandleList(keys);
@@ -481,13 +2466,39 @@ public:
     {
         VLOG(1) << __PRETTY_FUNCTION__ << ": " << storageID << ", " << format << ", " << parent;
 
+        // see getObjectList
+        bool anywhere = parent == 0 && format != 0;
+
+        if (parent == MTP_PARENT_ROOT)
+            parent = 0;
+        else
+            browse(parent);
+
         int result = 0;
 
         try
         {
-            MtpObjectHandleList *list = getObjectList(storageID, format, parent);
-            result = list->size();
-            delete list;
+            // the same objects as getObjectList, without looking them up
+            if (anywhere && storageID == kAllStorages) {
+                std::shared_ptr<const ShardTable> table = shard_table();
+                std::map<MtpStorageID, std::shared_ptr<Shard> >::const_iterator it;
+
+                for (it = table->storages.begin(); it != table->storages.end(); ++it)
+                    result += count_format(*it->second, format);
+            } else if (anywhere) {
+                if (std::shared_ptr<Shard> shard = storage_shard(storageID))
+                    result = count_format(*shard, format);
+            } else if (parent != 0) {
+                if (std::shared_ptr<Shard> shard = find_shard(parent))
+                    result = count_listing(*shard, storageID, parent, format);
+            } else if (storageID == kAllStorages) {
+                std::shared_ptr<const ShardTable> table = shard_table();
+                std::map<MtpStorageID, std::shared_ptr<Shard> >::const_iterator it;
+
+                for (it = table->storages.begin(); it != table->storages.end(); ++it)
+                    result += count_listing(*it->second, storageID, parent, format);
+            } else if (std::shared_ptr<Shard> shard = storage_shard(storageID))
+                result = count_listing(*shard, storageID, parent, format);
         } catch(...)
         {
         }
@@ -519,8 +2530,10 @@ public:
             MTP_FORMAT_TIFF_IT,
             MTP_FORMAT_JP2,
             MTP_FORMAT_JPX,
+            MTP_FORMAT_DNG,
 
             /* Supported audio formats */
+            MTP_FORMAT_AIFF,
             MTP_FORMAT_OGG,
             MTP_FORMAT_MP3,
             MTP_FORMAT_WAV,
@@ -529,13 +2542,25 @@ public:
             MTP_FORMAT_FLAC,
 
             /* Supported video formats */
-            // none listed yet, video apparently broken.
+            MTP_FORMAT_UNDEFINED_VIDEO,
+            MTP_FORMAT_AVI,
+            MTP_FORMAT_MPEG,
+            MTP_FORMAT_ASF,
+            MTP_FORMAT_WMV,
+            MTP_FORMAT_MP4_CONTAINER,
+            MTP_FORMAT_3GP_CONTAINER,
 
             /* Audio album, and album art */
             MTP_FORMAT_ABSTRACT_AUDIO_ALBUM,
 
             /* Playlists for audio and video */
             MTP_FORMAT_ABSTRACT_AV_PLAYLIST,
+            MTP_FORMAT_M3U_PLAYLIST,
+            MTP_FORMAT_PLS_PLAYLIST,
+
+            /* Documents */
+            MTP_FORMAT_UNDEFINED_DOCUMENT,
+            MTP_FORMAT_XML_DOCUMENT,
         };
 
         return new MtpObjectFormatList{list};
@@ -556,26 +2581,13 @@ public:
             return nullptr;
         */
 
-        static const MtpObjectPropertyList list =
-        {
-            MTP_PROPERTY_STORAGE_ID,
-            MTP_PROPERTY_PARENT_OBJECT,
-            MTP_PROPERTY_OBJECT_FORMAT,
-            MTP_PROPERTY_OBJECT_SIZE,
-            MTP_PROPERTY_OBJECT_FILE_NAME,
-            MTP_PROPERTY_DISPLAY_NAME,
-            MTP_PROPERTY_PERSISTENT_UID,
-            MTP_PROPERTY_ASSOCIATION_TYPE,
-            MTP_PROPERTY_ASSOCIATION_DESC,
-            MTP_PROPERTY_PROTECTION_STATUS,
-            MTP_PROPERTY_DATE_CREATED,
-            MTP_PROPERTY_DATE_MODIFIED,
-            MTP_PROPERTY_HIDDEN,
-            MTP_PROPERTY_NON_CONSUMABLE,
+        MtpObjectPropertyList* list = new MtpObjectPropertyList();
 
-        };
+        BOOST_FOREACH(const ObjectProperty& property, object_properties()) {
+            list->push_back(property.code);
+        }
 
-        return new MtpObjectPropertyList{list};
+        return list;
     }
 
     virtual MtpDevicePropertyList* getSupportedDeviceProperties()
@@ -593,8 +2605,6 @@ public:
         MtpObjectProperty property,
         MtpDataPacket& packet)
     {
-        char date[20];
-
         VLOG(1) << __PRETTY_FUNCTION__
                 << " handle: " << handle
                 << " property: " << MtpDebug::getObjectPropCodeName(property);
@@ -602,43 +2612,14 @@ public:
         if (handle == MTP_PARENT_ROOT || handle == 0)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        if (!find_object_property(property))
+            return MTP_RESPONSE_GENERAL_ERROR;
+
+        std::shared_ptr<const ObjectStore> pinned = snapshot(handle);
+        const ObjectStore& db = *pinned;
+
         try {
-            switch(property)
-            {
-                case MTP_PROPERTY_STORAGE_ID: packet.putUInt32(db.at(handle).storage_id); break;
-                case MTP_PROPERTY_PARENT_OBJECT: packet.putUInt32(db.at(handle).parent); break;
-                case MTP_PROPERTY_OBJECT_FORMAT: packet.putUInt16(db.at(handle).object_format); break;
-                case MTP_PROPERTY_OBJECT_SIZE: packet.putUInt64(db.at(handle).object_size); break;
-                case MTP_PROPERTY_DISPLAY_NAME: packet.putString(db.at(handle).display_name.c_str()); break;
-                case MTP_PROPERTY_OBJECT_FILE_NAME: packet.putString(db.at(handle).display_name.c_str()); break;
-                case MTP_PROPERTY_PERSISTENT_UID: packet.putUInt128(handle); break;
-                case MTP_PROPERTY_ASSOCIATION_TYPE:
-                    if (db.at(handle).object_format == MTP_FORMAT_ASSOCIATION)
-                        packet.putUInt16(MTP_ASSOCIATION_TYPE_GENERIC_FOLDER);
-                    else
-                        packet.putUInt16(0);
-                    break;
-                case MTP_PROPERTY_ASSOCIATION_DESC: packet.putUInt32(0); break;
-                case MTP_PROPERTY_PROTECTION_STATUS:
-                    packet.putUInt16(0x0000); // no files are read-only for now.
-                    break;
-                case MTP_PROPERTY_DATE_CREATED:
-                    formatDateTime(0, date, sizeof(date));
-                    packet.putString(date);
-                    break;
-                case MTP_PROPERTY_DATE_MODIFIED:
-                    formatDateTime(db.at(handle).last_modified, date, sizeof(date));
-                    packet.putString(date);
-                    break;
-                case MTP_PROPERTY_HIDDEN: packet.putUInt16(0); break;
-                case MTP_PROPERTY_NON_CONSUMABLE: break;
-                    if (db.at(handle).object_format == MTP_FORMAT_ASSOCIATION)
-                        packet.putUInt16(0); // folders are non-consumable
-                    else
-                        packet.putUInt16(1); // files can usually be played.
-                    break;
-                default: return MTP_RESPONSE_GENERAL_ERROR; break;
-            }
+            put_property_value(packet, db, handle, object_format(db, handle), property);
 
             return MTP_RESPONSE_OK;
         }
@@ -656,7 +2637,8 @@ public:
         MtpObjectProperty property,
         MtpDataPacket& packet)
     {
-        DbEntry entry;
+        MtpObjectHandle parent;
+        MtpObjectHandle existing;
         MtpStringBuffer buffer;
         std::string oldname;
         std::string newname;
@@ -670,25 +2652,53 @@ public:
         if (handle == MTP_PARENT_ROOT || handle == 0)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        std::shared_ptr<Shard> shard = find_shard(handle);
+
+        if (!shard)
+            return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+
+        Transaction tx(*this, shard);
+        ObjectStore& db = tx.db();
+
         switch(property)
         {
             case MTP_PROPERTY_OBJECT_FILE_NAME:
                 try {
-                    entry = db.at(handle);
+                    oldpath /= db.path(handle);
 
                     if (!packet.getString(buffer)) {
                         LOG(ERROR) << "Cannot read packet";
                         return MTP_RESPONSE_GENERAL_ERROR;
                     }
-                    newname = strdup(buffer);
+                    newname = static_cast<const char*>(buffer);
 
-                    oldpath /= entry.path;
                     newpath /= oldpath.parent_path() / "/" / newname;
 
-                    boost::filesystem::rename(oldpath, newpath);
+                    existing = db.find_name(db.storage_id(handle), db.parent(handle), newname);
+                    // the host may well send the name the object already has
+                    if (existing == handle)
+                        break;
+                    if (existing != 0) {
+                        LOG(ERROR) << newpath << " already exists";
+                        return MTP_RESPONSE_INVALID_OBJECT_PROP_VALUE;
+                    }
+
+                    beginPathMutation(oldpath.string());
+                    beginPathMutation(newpath.string());
+                    try {
+                        boost::filesystem::rename(oldpath, newpath);
+                    } catch (...) {
+                        endPathMutation(newpath.string());
+                        endPathMutation(oldpath.string());
+                        throw;
+                    }
+                    endPathMutation(newpath.string());
+                    endPathMutation(oldpath.string());
 
-                    db.at(handle).display_name = newname;
-                    db.at(handle).path = newpath.string();
+                    db.rename(handle, newname);
+                    if (db.object_format(handle) != MTP_FORMAT_ASSOCIATION)
+                        classify(db, handle);
+                    tx.commit();
                 } catch (filesystem_error& fe) {
                     LOG(ERROR) << fe.what();
                     return MTP_RESPONSE_DEVICE_BUSY;
@@ -703,8 +2713,8 @@ public:
                 break;
             case MTP_PROPERTY_PARENT_OBJECT:
                 try {
-                    entry = db.at(handle);
-                    if (!packet.getUInt32(entry.parent)) {
+                    parent = db.parent(handle);
+                    if (!packet.getUInt32(parent)) {
                         LOG(ERROR) << "Cannot read packet";
                         return MTP_RESPONSE_GENERAL_ERROR;
                     }
@@ -760,181 +2770,105 @@ public:
         int depth,
         MtpDataPacket& packet)
     {
-        std::vector<MtpObjectHandle> handles;
-
         VLOG(2) << __PRETTY_FUNCTION__;
 
-        if (handle == kInvalidObjectHandle)
-            return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+        std::vector<const ObjectProperty*> selected;
+        std::shared_ptr<const ObjectStore> single;
+        std::vector<Listing> pinned;
+        std::vector<ListedObject> objects;
+        // 0xFFFFFFFF is every level
+        uint32_t levels = depth;
+        size_t rows = 0;
+        size_t size = 4;
 
         if (property == 0 && groupCode == 0)
             return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
 
-        if (groupCode != 0)
-            return MTP_RESPONSE_SPECIFICATION_BY_GROUP_UNSUPPORTED;
-
-        if (depth > 1)
-            return MTP_RESPONSE_SPECIFICATION_BY_DEPTH_UNSUPPORTED;
+        if (property == ALL_PROPERTIES) {
+            BOOST_FOREACH(const ObjectProperty& p, object_properties()) {
+                selected.push_back(&p);
+            }
+        } else if (property != 0) {
+            if (!find_object_property(property))
+                return MTP_RESPONSE_OBJECT_PROP_NOT_SUPPORTED;
+            selected.push_back(find_object_property(property));
+        } else {
+            BOOST_FOREACH(const ObjectProperty& p, object_properties()) {
+                if (p.group == static_cast<uint32_t>(groupCode))
+                    selected.push_back(&p);
+            }
+            if (selected.empty())
+                return MTP_RESPONSE_SPECIFICATION_BY_GROUP_UNSUPPORTED;
+        }
 
-        if (depth == 0) {
+        if (handle == kInvalidObjectHandle) {
+            // every object on every storage
+            collect_subtree(0, 0xFFFFFFFF, pinned, objects);
+        } else if (levels == 0) {
             /* For a depth search, a handle of 0 is valid (objects at the root)
              * but it isn't when querying for the properties of a single object.
              */
-            if (db.find(handle) == db.end())
+            single = snapshot(handle);
+            if (!single->contains(handle))
                 return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
-            handles.push_back(handle);
+            prioritize(*single, handle);
+            objects.push_back(ListedObject(single.get(), handle));
         } else {
-            BOOST_FOREACH(MtpObjectHandle i, db | boost::adaptors::map_keys) {
-                if (db.at(i).parent == handle)
-                    handles.push_back(i);
-            }
-        }
-
-        /*
-         * getObjectPropList returns an ObjectPropList dataset table;
-         * built as such:
-         *
-         * 1- Number of elements (quadruples)
-         * a1- Element 1 Object Handle
-         * a2- Element 1 Property Code
-         * a3- Element 1 Data type
-         * a4- Element 1 Value
-         * b... rinse, repeat.
-         */
-
-        if (property == ALL_PROPERTIES)
-             packet.putUInt32(6 * handles.size());
-        else
-             packet.putUInt32(1 * handles.size());
-
-        BOOST_FOREACH(MtpObjectHandle i, handles) {
-            DbEntry entry = db.at(i);
-
-            // Persistent Unique Identifier.
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_PERSISTENT_UID) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_PERSISTENT_UID);
-                packet.putUInt16(MTP_TYPE_UINT128);
-                packet.putUInt128(i);
-            }
-
-            // Storage ID
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_STORAGE_ID) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_STORAGE_ID);
-                packet.putUInt16(MTP_TYPE_UINT32);
-                packet.putUInt32(entry.storage_id);
-            }
-
-            // Parent
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_PARENT_OBJECT) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_PARENT_OBJECT);
-                packet.putUInt16(MTP_TYPE_UINT32);
-                packet.putUInt32(entry.parent);
-            }
-
-            // Object Format
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_OBJECT_FORMAT) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_OBJECT_FORMAT);
-                packet.putUInt16(MTP_TYPE_UINT16);
-                packet.putUInt16(entry.object_format);
-            }
-
-            // Object Size
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_OBJECT_SIZE) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_OBJECT_SIZE);
-                packet.putUInt16(MTP_TYPE_UINT64);
-                packet.putUInt64(entry.object_size);
-            }
-
-            // Object File Name
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_OBJECT_FILE_NAME) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_OBJECT_FILE_NAME);
-                packet.putUInt16(MTP_TYPE_STR);
-                packet.putString(entry.display_name.c_str());
-            }
-
-            // Display Name
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_DISPLAY_NAME) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_DISPLAY_NAME);
-                packet.putUInt16(MTP_TYPE_STR);
-                packet.putString(entry.display_name.c_str());
-            }
-
-            // Association Type
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_ASSOCIATION_TYPE) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_ASSOCIATION_TYPE);
-                packet.putUInt16(MTP_TYPE_UINT16);
-                if (entry.object_format == MTP_FORMAT_ASSOCIATION)
-                    packet.putUInt16(MTP_ASSOCIATION_TYPE_GENERIC_FOLDER);
-                else
-                    packet.putUInt16(0);
-            }
-
-            // Association Description
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_ASSOCIATION_DESC) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_ASSOCIATION_DESC);
-                packet.putUInt16(MTP_TYPE_UINT32);
-                packet.putUInt32(0);
-            }
+            if (handle != 0 && !snapshot(handle)->contains(handle))
+                return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
-            // Protection Status
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_PROTECTION_STATUS) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_PROTECTION_STATUS);
-                packet.putUInt16(MTP_TYPE_UINT16);
-                packet.putUInt16(0x0000); //FIXME: all files are read-write for now
-                // packet.putUInt16(0x8001);
-            }
+            if (levels == 1 && handle != 0)
+                browse(handle);
+            collect_subtree(handle, levels, pinned, objects);
+        }
 
-            // Date Created
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_DATE_CREATED) {
-                char date[20];
-                formatDateTime(0, date, sizeof(date));
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_DATE_CREATED);
-                packet.putUInt16(MTP_TYPE_STR);
-                packet.putString(date);
-            }
+        try {
+            /* The reply is sized before anything is written, so the packet
+             * buffer is allocated once rather than grown in small steps as
+             * the rows come in.
+             */
+            size_t kept = 0;
 
-            // Date Modified
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_DATE_MODIFIED) {
-                char date[20];
-                formatDateTime(entry.last_modified, date, sizeof(date));
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_DATE_CREATED);
-                packet.putUInt16(MTP_TYPE_STR);
-                packet.putString(date);
-            }
+            BOOST_FOREACH(ListedObject& object, objects) {
+                object.format = object_format(*object.db, object.handle);
+                if (format != 0 && object.format != format)
+                    continue;
 
-            // Hidden
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_HIDDEN) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_HIDDEN);
-                packet.putUInt16(MTP_TYPE_UINT16);
-                packet.putUInt16(0);
+                objects[kept++] = object;
+                BOOST_FOREACH(const ObjectProperty* p, selected) {
+                    // handle, property code and data type
+                    size += 8 + value_size(*object.db, object.handle, *p);
+                }
             }
-
-            // Non Consumable
-            if (property == ALL_PROPERTIES || property == MTP_PROPERTY_NON_CONSUMABLE) {
-                packet.putUInt32(i);
-                packet.putUInt16(MTP_PROPERTY_NON_CONSUMABLE);
-                packet.putUInt16(MTP_TYPE_UINT16);
-                if (entry.object_format == MTP_FORMAT_ASSOCIATION)
-                    packet.putUInt16(0); // folders are non-consumable
-                else
-                    packet.putUInt16(1); // files can usually be played.
-                break;
+            objects.erase(objects.begin() + kept, objects.end());
+            rows = objects.size() * selected.size();
+            packet.allocate(MTP_CONTAINER_HEADER_SIZE + size);
+
+            /*
+             * getObjectPropList returns an ObjectPropList dataset table;
+             * built as such:
+             *
+             * 1- Number of elements (quadruples)
+             * a1- Element 1 Object Handle
+             * a2- Element 1 Property Code
+             * a3- Element 1 Data type
+             * a4- Element 1 Value
+             * b... rinse, repeat.
+             */
+            packet.putUInt32(rows);
+
+            BOOST_FOREACH(const ListedObject& object, objects) {
+                BOOST_FOREACH(const ObjectProperty* p, selected) {
+                    packet.putUInt32(object.handle);
+                    packet.putUInt16(p->code);
+                    packet.putUInt16(p->type);
+                    put_property_value(packet, *object.db, object.handle, object.format, p->code);
+                }
             }
-
+        } catch (...) {
+            LOG(ERROR) << __PRETTY_FUNCTION__ << ": could not list the properties of " << handle;
+            return MTP_RESPONSE_GENERAL_ERROR;
         }
 
         return MTP_RESPONSE_OK;
@@ -949,12 +2883,15 @@ public:
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        std::shared_ptr<const ObjectStore> pinned = snapshot(handle);
+        const ObjectStore& db = *pinned;
+
         try {
-            uint64_t object_size = db.at(handle).object_size;
+            uint64_t object_size = db.object_size(handle);
 
             info.mHandle = handle;
-            info.mStorageID = db.at(handle).storage_id;
-            info.mFormat = db.at(handle).object_format;
+            info.mStorageID = db.storage_id(handle);
+            info.mFormat = object_format(db, handle);
             info.mProtectionStatus = 0x0;
             if (object_size > UINT64_C(0xFFFFFFFF))
                 info.mCompressedSize = UINT64_C(0xFFFFFFFF);
@@ -963,20 +2900,26 @@ public:
             info.mImagePixWidth = 0;
             info.mImagePixHeight = 0;
             info.mImagePixDepth = 0;
-            info.mParent = db.at(handle).parent;
+            info.mParent = db.parent(handle);
             info.mAssociationType
                 = info.mFormat == MTP_FORMAT_ASSOCIATION
                     ? MTP_ASSOCIATION_TYPE_GENERIC_FOLDER : 0;
             info.mAssociationDesc = 0;
             info.mSequenceNumber = 0;
-            info.mName = ::strdup(db.at(handle).display_name.c_str());
-            info.mDateCreated = 0;
-            info.mDateModified = db.at(handle).last_modified;
+            info.mName = ::strdup(db.name(handle).c_str());
+            info.mDateCreated = db.date_created(handle);
+            info.mDateModified = db.last_modified(handle);
             info.mKeywords = ::strdup("droidian");
 
+            ObjectStore::EncodedStrings strings = db.encoded(handle);
+
+            info.mEncodedStrings.assign(strings.data(), strings.data() + strings.size());
+
             if (VLOG_IS_ON(2))
                 info.print();
 
+            prioritize(db, handle);
+
             return MTP_RESPONSE_OK;
         }
         catch (...) {
@@ -1005,18 +2948,19 @@ public:
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        std::shared_ptr<const ObjectStore> pinned = snapshot(handle);
+        const ObjectStore& db = *pinned;
+
         try {
-            DbEntry entry = db.at(handle);
+            outFilePath = db.path(handle);
+            outFileLength = db.object_size(handle);
+            outFormat = object_format(db, handle);
 
             VLOG(2) << __PRETTY_FUNCTION__
                     << "handle: " << handle
-                    << "path: " << entry.path
-                    << "length: " << entry.object_size
-                    << "format: " << entry.object_format;
-
-            outFilePath = std::string(entry.path);
-            outFileLength = entry.object_size;
-            outFormat = entry.object_format;
+                    << "path: " << outFilePath
+                    << "length: " << outFileLength
+                    << "format: " << outFormat;
 
             return MTP_RESPONSE_OK;
         }
@@ -1027,38 +2971,26 @@ public:
 
     virtual MtpResponseCode deleteFile(MtpObjectHandle handle)
     {
-        size_t orig_size = db.size();
-        size_t new_size;
-
         VLOG(2) << __PRETTY_FUNCTION__ << " handle: " << handle;
 
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
-        try {
-            if (db.at(handle).object_format == MTP_FORMAT_ASSOCIATION)
-                inotify_rm_watch(inotify_fd, db.at(handle).watch_fd);
+        std::shared_ptr<Shard> shard = find_shard(handle);
 
-            new_size = db.erase(handle);
+        if (!shard)
+            return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
-            if (orig_size > new_size) {
-                /* Recursively remove children object from the DB as well.
-                 * we can safely ignore failures here, since the objects
-                 * would not be reachable anyway.
-                 */
-                BOOST_FOREACH(MtpObjectHandle i, db | boost::adaptors::map_keys) {
-                    if (db.at(i).parent == handle)
-                        db.erase(i);
-                }
+        Transaction tx(*this, shard);
 
-                return MTP_RESPONSE_OK;
-            }
-            else
-                return MTP_RESPONSE_GENERAL_ERROR;
-        }
-        catch (...) {
+        /* Recursively remove children object from the DB as well,
+         * they would not be reachable anyway.
+         */
+        if (erase_entry(tx, handle) > 0) {
+            tx.commit();
+            return MTP_RESPONSE_OK;
+        } else
             return MTP_RESPONSE_GENERAL_ERROR;
-        }
     }
 
     virtual MtpResponseCode moveFile(MtpObjectHandle handle, MtpObjectHandle new_parent)
@@ -1069,14 +3001,55 @@ public:
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
-        try {
-            // change parent
-            db.at(handle).parent = new_parent;
-        }
-        catch (...) {
+        std::shared_ptr<Shard> shard = find_shard(handle);
+
+        if (!shard)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+
+        Transaction tx(*this, shard);
+        ObjectStore& db = tx.db();
+
+        if (!db.contains(handle))
+            return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+
+        MtpStorageID storage = db.storage_id(handle);
+
+        // the directories storages are backed by stay where they are
+        if (db.parent(handle) == MTP_PARENT_ROOT
+                || (storage == MTP_STORAGE_FIXED_RAM && db.parent(handle) == 0))
+            return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+
+        if (new_parent == 0) {
+            // the home storage has no objects outside of its directory
+            if (storage == MTP_STORAGE_FIXED_RAM)
+                return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+        } else {
+            if (!db.contains(new_parent)
+                    || db.storage_id(new_parent) != storage
+                    || db.object_format(new_parent) != MTP_FORMAT_ASSOCIATION)
+                return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+
+            // a directory can't be moved below itself
+            for (MtpObjectHandle i = new_parent;
+                 i != 0 && i != MTP_PARENT_ROOT;
+                 i = db.parent(i)) {
+                if (i == handle)
+                    return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+            }
+
+            new_parent = child_parent(db, new_parent);
+        }
+
+        if (new_parent != db.parent(handle)
+                && db.find_name(storage, new_parent, db.name(handle)) != 0) {
+            LOG(ERROR) << db.name(handle) << " already exists in the destination";
+            return MTP_RESPONSE_GENERAL_ERROR;
         }
 
+        // change parent
+        db.reparent(handle, new_parent);
+        tx.commit();
+
         return MTP_RESPONSE_OK;
     }
 
@@ -1099,9 +3072,11 @@ public:
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return nullptr;
 
-        return getObjectList(db.at(handle).storage_id,
+        std::shared_ptr<const ObjectStore> db = snapshot(handle);
+
+        return getObjectList(db->storage_id(handle),
                              handle,
-                             db.at(handle).object_format);
+                             db->object_format(handle));
     }
 
     virtual MtpResponseCode setObjectReferences(
@@ -1144,6 +3119,9 @@ public:
             default: break;
         }
 
+        if (result && find_object_property(property))
+            result->mGroupCode = find_object_property(property)->group;
+
         return result;
     }
 
@@ -1163,17 +3141,36 @@ public:
         return result;
     }
 
+    /* Callers read this before querying and commits only bump it after
+     * publishing, so an answer is never filed under a generation newer
+     * than the data it came from.
+     */
+    virtual uint64_t getGeneration()
+    {
+        return generation;
+    }
+
     virtual void sessionStarted(MtpServer* server)
     {
         VLOG(1) << __PRETTY_FUNCTION__;
         local_server = server;
+
+        // they may have changed while no host was connected
+        io_svc.post(boost::bind(&DroidianMtpDatabase::resync_unreliable, this));
     }
 
     virtual void sessionEnded()
     {
+        size_t objects = 0;
+
         VLOG(1) << __PRETTY_FUNCTION__;
-        VLOG(1) << "objects in db at session end: " << db.size();
+        BOOST_FOREACH(const std::shared_ptr<Shard>& shard, all_shards()) {
+            objects += shard->snapshot()->size();
+        }
+        VLOG(1) << "objects in db at session end: " << objects;
         local_server = nullptr;
+
+        save_indexes();
     }
 };
 }
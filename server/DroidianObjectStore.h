@@ -0,0 +1,1034 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DROIDIAN_OBJECT_STORE_H_
+#define DROIDIAN_OBJECT_STORE_H_
+
+#include <mtp.h>
+#include <MtpStringBuffer.h>
+#include <MtpTypes.h>
+#include <MtpUtils.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+namespace android
+{
+struct DbEntry
+{
+    MtpStorageID storage_id;
+    MtpObjectFormat object_format;
+    MtpObjectHandle parent;
+    uint64_t object_size;
+    std::string display_name;
+    int watch_fd;
+    std::time_t last_modified;
+    std::time_t date_created;
+};
+
+/* Object table of the database.
+ *
+ * Entries are addressed directly by handle: all handles of a store share
+ * the same top bits, its prefix, and the low kHandleBits locate the entry.
+ * They are kept as a structure of arrays in fixed-size pages, with the
+ * names of a page packed into one arena. A page is freed along with its
+ * last object, its range of handles can then be handed out again, see
+ * free_range. Entries only
+ * know their own name and their parent, full paths are rebuilt from the
+ * parent chain when asked for, which also makes renaming or moving a
+ * directory independent of the size of its subtree.
+ *
+ * The store also keeps the lookup indexes: objects by the (storage, parent)
+ * listing they appear in, by file name within that listing, by storage
+ * and format, and directories by their inotify watch descriptor.
+ *
+ * Copying a store is cheap: pages and index buckets are shared between
+ * the copies and only duplicated the first time a copy modifies them,
+ * which lets the database publish immutable snapshots to its readers.
+ *
+ * Names and dates are also kept the way they go out to the host, as MTP
+ * strings. Those are encoded when first asked for, a page at a time, and
+ * only re-encoded for the objects that were renamed or modified since.
+ */
+class ObjectStore
+{
+public:
+    typedef std::pair<MtpStorageID, MtpObjectHandle> ChildKey;
+    // (storage, format, page of the handles)
+    typedef std::tuple<MtpStorageID, MtpObjectFormat, uint32_t> FormatKey;
+    // (storage, parent, format), kAnyParent for the whole storage
+    typedef std::tuple<MtpStorageID, MtpObjectHandle, MtpObjectFormat> CountKey;
+    typedef std::vector<MtpObjectHandle> HandleList;
+
+    static const unsigned kHandleBits = 24;
+    static const MtpObjectHandle kHandleMask = (1u << kHandleBits) - 1;
+
+    class EncodedStrings;
+
+private:
+    static const size_t kPageBits = 10;
+    static const size_t kPageSize = 1 << kPageBits;
+    // compact a page arena once this many bytes in it are unused
+    static const size_t kArenaSlack = 4096;
+    static const size_t kIndexBuckets = 64;
+    // neither a handle nor MTP_PARENT_ROOT, see CountKey
+    static const MtpObjectHandle kAnyParent = 0xFFFFFFFE;
+
+    /* The names and dates of a page as MTP strings, back to back for each
+     * object in the order ObjectInfo has them. Never modified once built.
+     */
+    struct Encoding
+    {
+        // stamps of the objects when they were encoded, see Page
+        uint32_t stamp[kPageSize];
+        uint32_t offset[kPageSize];
+        uint16_t name_size[kPageSize];
+        uint8_t date_size[kPageSize][2];
+        std::string data;
+    };
+
+    /* Readers fill in the encoding of published pages, so it is only ever
+     * accessed atomically, also when the page is copied.
+     */
+    class SharedEncoding
+    {
+    private:
+        std::shared_ptr<const Encoding> encoding;
+
+    public:
+        SharedEncoding() {}
+        SharedEncoding(const SharedEncoding& other) : encoding(other.load()) {}
+        SharedEncoding& operator=(const SharedEncoding&) = delete;
+
+        std::shared_ptr<const Encoding> load() const { return std::atomic_load(&encoding); }
+        void store(const std::shared_ptr<const Encoding>& e) { std::atomic_store(&encoding, e); }
+    };
+
+    struct Page
+    {
+        MtpStorageID storage_id[kPageSize];
+        MtpObjectHandle parent[kPageSize];
+        uint64_t object_size[kPageSize];
+        std::time_t last_modified[kPageSize];
+        std::time_t date_created[kPageSize];
+        int32_t watch_fd[kPageSize];
+        uint32_t name_offset[kPageSize];
+        uint16_t name_length[kPageSize];
+        MtpObjectFormat object_format[kPageSize];
+        // bumped whenever the name or a date of an object changes
+        uint32_t stamp[kPageSize];
+        std::bitset<kPageSize> live;
+        // directories whose entries haven't been read yet
+        std::bitset<kPageSize> unlisted;
+        // files whose format is still to be read from their contents
+        std::bitset<kPageSize> unsniffed;
+
+        std::string arena;
+        size_t garbage;
+        // store that owns this page and may modify it in place
+        uint64_t generation;
+        mutable SharedEncoding encoded;
+
+        explicit Page(uint64_t generation) : garbage(0), generation(generation)
+        {
+            std::fill(stamp, stamp + kPageSize, 0);
+        }
+    };
+
+    // an index split into buckets that are copied on write independently
+    template <typename Map>
+    class Index
+    {
+    private:
+        struct Bucket
+        {
+            Map map;
+            uint64_t generation;
+        };
+
+        std::shared_ptr<Bucket> buckets[kIndexBuckets];
+
+    public:
+        explicit Index(uint64_t generation)
+        {
+            for (size_t i = 0; i < kIndexBuckets; i++) {
+                buckets[i] = std::make_shared<Bucket>();
+                buckets[i]->generation = generation;
+            }
+        }
+
+        const Map& get(std::size_t hash) const
+        {
+            return buckets[hash % kIndexBuckets]->map;
+        }
+
+        Map& edit(std::size_t hash, uint64_t generation)
+        {
+            std::shared_ptr<Bucket>& bucket = buckets[hash % kIndexBuckets];
+
+            if (bucket->generation != generation) {
+                bucket = std::make_shared<Bucket>(*bucket);
+                bucket->generation = generation;
+            }
+
+            return bucket->map;
+        }
+    };
+
+    typedef std::map<ChildKey, HandleList> ChildMap;
+    typedef std::map<FormatKey, HandleList> FormatMap;
+
+    struct Count
+    {
+        uint32_t objects;
+        // of those, files whose format may still change, see unsniffed
+        uint32_t unsniffed;
+
+        Count() : objects(0), unsniffed(0) {}
+    };
+
+    typedef std::unordered_map<CountKey, Count, boost::hash<CountKey> > CountMap;
+    typedef std::unordered_multimap<std::size_t, MtpObjectHandle> NameMap;
+    typedef std::unordered_map<int, MtpObjectHandle> WatchMap;
+    typedef std::map<MtpStorageID, std::pair<MtpObjectHandle, std::string> > RootMap;
+
+    uint64_t generation;
+    // anything changed since the store was made or copied
+    bool dirty;
+    MtpObjectHandle prefix;
+    std::vector<std::shared_ptr<Page> > pages;
+    size_t count;
+
+    // sorted handle lists, one per (storage, parent) listing
+    Index<ChildMap> children;
+    // hash of (storage, parent, name) -> handle
+    Index<NameMap> names;
+    /* sorted handle lists by format, split by page so that changing one
+     * object never copies more than a page worth of handles
+     */
+    Index<FormatMap> formats;
+    // number of objects of each format in each listing
+    Index<CountMap> counts;
+    // inotify watch descriptor -> handle of the watched directory
+    Index<WatchMap> watches;
+    // storage -> handle and absolute path of its top-level directory
+    std::shared_ptr<const RootMap> roots;
+
+    static uint64_t next_generation()
+    {
+        static std::atomic<uint64_t> last(0);
+
+        return ++last;
+    }
+
+    static std::size_t child_hash(const ChildKey& key)
+    {
+        return boost::hash<ChildKey>()(key);
+    }
+
+    static std::size_t format_hash(const FormatKey& key)
+    {
+        return boost::hash<FormatKey>()(key);
+    }
+
+    static std::size_t count_hash(const CountKey& key)
+    {
+        return boost::hash<CountKey>()(key);
+    }
+
+    static size_t slot(MtpObjectHandle handle) { return handle & (kPageSize - 1); }
+    static size_t page_index(MtpObjectHandle handle) { return (handle & kHandleMask) >> kPageBits; }
+
+    const Page& page(MtpObjectHandle handle) const
+    {
+        if (!contains(handle))
+            throw std::out_of_range("no such object handle");
+        return *pages[page_index(handle)];
+    }
+
+    Page& edit_page(MtpObjectHandle handle)
+    {
+        if (!contains(handle))
+            throw std::out_of_range("no such object handle");
+
+        std::shared_ptr<Page>& p = pages[page_index(handle)];
+
+        dirty = true;
+        if (p->generation != generation) {
+            p = std::make_shared<Page>(*p);
+            p->generation = generation;
+        }
+
+        return *p;
+    }
+
+    template <typename Map>
+    Map& edit(Index<Map>& index, std::size_t hash)
+    {
+        dirty = true;
+        return index.edit(hash, generation);
+    }
+
+    static std::size_t name_hash(MtpStorageID storage,
+                                 MtpObjectHandle parent,
+                                 const char* name,
+                                 size_t length)
+    {
+        std::size_t seed = boost::hash_range(name, name + length);
+
+        boost::hash_combine(seed, storage);
+        boost::hash_combine(seed, parent);
+        return seed;
+    }
+
+    std::size_t name_hash(MtpObjectHandle handle) const
+    {
+        const Page& p = page(handle);
+        size_t i = slot(handle);
+
+        return name_hash(p.storage_id[i], p.parent[i],
+                         p.arena.data() + p.name_offset[i], p.name_length[i]);
+    }
+
+    void set_name(Page& p, size_t i, const std::string& name)
+    {
+        p.stamp[i]++;
+        p.name_offset[i] = p.arena.size();
+        p.name_length[i] = std::min<size_t>(name.size(), UINT16_MAX);
+        p.arena.append(name, 0, p.name_length[i]);
+    }
+
+    void release_name(Page& p, size_t i)
+    {
+        p.garbage += p.name_length[i];
+        if (p.garbage < kArenaSlack || p.garbage < p.arena.size() / 2)
+            return;
+
+        std::string arena;
+
+        arena.reserve(p.arena.size() - p.garbage);
+        for (size_t j = 0; j < kPageSize; j++) {
+            if (!p.live[j] || j == i)
+                continue;
+
+            uint32_t offset = arena.size();
+
+            arena.append(p.arena, p.name_offset[j], p.name_length[j]);
+            p.name_offset[j] = offset;
+        }
+
+        p.arena.swap(arena);
+        p.garbage = 0;
+        p.name_length[i] = 0;
+        p.name_offset[i] = 0;
+    }
+
+    static size_t append_string(std::string& out, const char* s)
+    {
+        MtpStringBuffer string(s);
+        uint8_t buffer[MTP_STRING_MAX_ENCODED_SIZE];
+        size_t size = string.encode(buffer);
+
+        out.append(reinterpret_cast<const char*>(buffer), size);
+        return size;
+    }
+
+    // the encoding of a page, reusing what is still current in an older one
+    static std::shared_ptr<const Encoding> encode_page(const Page& p, const Encoding* old)
+    {
+        std::shared_ptr<Encoding> result = std::make_shared<Encoding>();
+        char date[20];
+
+        if (old)
+            result->data.reserve(old->data.size());
+
+        for (size_t i = 0; i < kPageSize; i++) {
+            result->stamp[i] = p.stamp[i];
+            result->offset[i] = result->data.size();
+            result->name_size[i] = 0;
+            result->date_size[i][0] = result->date_size[i][1] = 0;
+            if (!p.live[i])
+                continue;
+
+            if (old && old->stamp[i] == p.stamp[i]) {
+                result->name_size[i] = old->name_size[i];
+                result->date_size[i][0] = old->date_size[i][0];
+                result->date_size[i][1] = old->date_size[i][1];
+                result->data.append(old->data, old->offset[i],
+                                    old->name_size[i] + old->date_size[i][0] + old->date_size[i][1]);
+                continue;
+            }
+
+            result->name_size[i] = append_string(result->data,
+                                                 std::string(p.arena, p.name_offset[i], p.name_length[i]).c_str());
+            formatDateTime(p.date_created[i], date, sizeof(date));
+            result->date_size[i][0] = append_string(result->data, date);
+            formatDateTime(p.last_modified[i], date, sizeof(date));
+            result->date_size[i][1] = append_string(result->data, date);
+        }
+
+        return result;
+    }
+
+    void link_child(MtpObjectHandle handle)
+    {
+        ChildKey key(storage_id(handle), parent(handle));
+        HandleList& list = edit(children, child_hash(key))[key];
+        std::size_t hash = name_hash(handle);
+
+        // handles mostly grow, so this is usually an append
+        if (list.empty() || list.back() < handle)
+            list.push_back(handle);
+        else
+            list.insert(std::lower_bound(list.begin(), list.end(), handle), handle);
+
+        edit(names, hash).insert(std::make_pair(hash, handle));
+        adjust_count(handle, 1);
+    }
+
+    void unlink_name(MtpObjectHandle handle)
+    {
+        std::size_t hash = name_hash(handle);
+        NameMap& bucket = edit(names, hash);
+        std::pair<NameMap::iterator, NameMap::iterator> range;
+
+        range = bucket.equal_range(hash);
+        for (; range.first != range.second; ++range.first) {
+            if (range.first->second == handle) {
+                bucket.erase(range.first);
+                break;
+            }
+        }
+    }
+
+    void adjust_count(const CountKey& key, bool unsniffed, int delta)
+    {
+        CountMap& bucket = edit(counts, count_hash(key));
+        Count& c = bucket[key];
+
+        c.objects += delta;
+        if (unsniffed)
+            c.unsniffed += delta;
+        if (c.objects == 0)
+            bucket.erase(key);
+    }
+
+    void adjust_count(MtpObjectHandle handle, int delta)
+    {
+        const Page& p = page(handle);
+        size_t i = slot(handle);
+        MtpObjectHandle any = kAnyParent;
+
+        adjust_count(CountKey(p.storage_id[i], p.parent[i], p.object_format[i]), p.unsniffed[i], delta);
+        adjust_count(CountKey(p.storage_id[i], any, p.object_format[i]), p.unsniffed[i], delta);
+    }
+
+    void unlink_child(MtpObjectHandle handle)
+    {
+        ChildKey key(storage_id(handle), parent(handle));
+        ChildMap& bucket = edit(children, child_hash(key));
+        ChildMap::iterator it;
+
+        unlink_name(handle);
+        adjust_count(handle, -1);
+
+        it = bucket.find(key);
+        if (it == bucket.end())
+            return;
+
+        HandleList::iterator pos = std::lower_bound(it->second.begin(),
+                                                    it->second.end(),
+                                                    handle);
+        if (pos != it->second.end() && *pos == handle)
+            it->second.erase(pos);
+
+        if (it->second.empty())
+            bucket.erase(it);
+    }
+
+    FormatKey format_key(MtpObjectHandle handle) const
+    {
+        return FormatKey(storage_id(handle), object_format(handle), page_index(handle));
+    }
+
+    void link_format(MtpObjectHandle handle)
+    {
+        FormatKey key = format_key(handle);
+        HandleList& list = edit(formats, format_hash(key))[key];
+
+        if (list.empty() || list.back() < handle)
+            list.push_back(handle);
+        else
+            list.insert(std::lower_bound(list.begin(), list.end(), handle), handle);
+    }
+
+    void unlink_format(MtpObjectHandle handle)
+    {
+        FormatKey key = format_key(handle);
+        FormatMap& bucket = edit(formats, format_hash(key));
+        FormatMap::iterator it;
+
+        it = bucket.find(key);
+        if (it == bucket.end())
+            return;
+
+        HandleList::iterator pos = std::lower_bound(it->second.begin(),
+                                                    it->second.end(),
+                                                    handle);
+        if (pos != it->second.end() && *pos == handle)
+            it->second.erase(pos);
+
+        if (it->second.empty())
+            bucket.erase(it);
+    }
+
+    // the lists of a format on a storage, in handle order
+    std::vector<const HandleList*> format_lists(MtpStorageID storage, MtpObjectFormat format) const
+    {
+        std::vector<std::pair<uint32_t, const HandleList*> > found;
+        std::vector<const HandleList*> result;
+        FormatKey first(storage, format, 0);
+
+        for (size_t b = 0; b < kIndexBuckets; b++) {
+            const FormatMap& bucket = formats.get(b);
+            FormatMap::const_iterator it = bucket.lower_bound(first);
+
+            for (; it != bucket.end()
+                     && std::get<0>(it->first) == storage
+                     && std::get<1>(it->first) == format;
+                 ++it)
+                found.push_back(std::make_pair(std::get<2>(it->first), &it->second));
+        }
+
+        std::sort(found.begin(), found.end());
+        for (size_t i = 0; i < found.size(); i++)
+            result.push_back(found[i].second);
+
+        return result;
+    }
+
+    void unwatch(MtpObjectHandle handle)
+    {
+        int wd = watch_fd(handle);
+        WatchMap::const_iterator it;
+
+        if (wd < 0)
+            return;
+
+        it = watches.get(wd).find(wd);
+        if (it != watches.get(wd).end() && it->second == handle)
+            edit(watches, wd).erase(wd);
+    }
+
+    void clear_slot(MtpObjectHandle handle)
+    {
+        Page& p = edit_page(handle);
+        size_t i = slot(handle);
+
+        unwatch(handle);
+        unlink_format(handle);
+        release_name(p, i);
+        p.live[i] = false;
+        count--;
+
+        if (p.live.none())
+            free_page(page_index(handle));
+    }
+
+    void free_page(size_t index)
+    {
+        pages[index].reset();
+        while (!pages.empty() && !pages.back())
+            pages.pop_back();
+    }
+
+public:
+    explicit ObjectStore(MtpObjectHandle prefix = 0) :
+        generation(next_generation()),
+        dirty(false),
+        prefix(prefix & ~kHandleMask),
+        count(0),
+        children(generation),
+        names(generation),
+        formats(generation),
+        counts(generation),
+        watches(generation),
+        roots(std::make_shared<RootMap>())
+    {
+    }
+
+    // the copy shares all data with the original until either is modified
+    ObjectStore(const ObjectStore& other) :
+        generation(next_generation()),
+        dirty(false),
+        prefix(other.prefix),
+        pages(other.pages),
+        count(other.count),
+        children(other.children),
+        names(other.names),
+        formats(other.formats),
+        counts(other.counts),
+        watches(other.watches),
+        roots(other.roots)
+    {
+    }
+
+    ObjectStore& operator=(const ObjectStore&) = delete;
+
+    // unique to every store, changes whenever a store is copied
+    uint64_t version() const { return generation; }
+
+    // whether anything was changed since the store was made or copied
+    bool modified() const { return dirty; }
+
+    bool contains(MtpObjectHandle handle) const
+    {
+        size_t index = page_index(handle);
+
+        return (handle & ~kHandleMask) == prefix
+            && index < pages.size() && pages[index] && pages[index]->live[slot(handle)];
+    }
+
+    size_t size() const { return count; }
+
+    static const MtpObjectHandle kPageHandles = kPageSize;
+
+    /* Low bits of the first handle of a range of kPageHandles that has no
+     * objects in it, looking from start on and wrapping around; 0 if all
+     * ranges are taken. Never the range of the handle 0.
+     */
+    MtpObjectHandle free_range(MtpObjectHandle start) const
+    {
+        size_t ranges = (kHandleMask + 1) / kPageSize;
+        size_t first = page_index(start);
+
+        for (size_t n = 0; n < ranges; n++) {
+            size_t index = (first + n) % ranges;
+
+            if (index != 0 && (index >= pages.size() || !pages[index]))
+                return index << kPageBits;
+        }
+
+        return 0;
+    }
+
+    MtpStorageID storage_id(MtpObjectHandle handle) const { return page(handle).storage_id[slot(handle)]; }
+    MtpObjectFormat object_format(MtpObjectHandle handle) const { return page(handle).object_format[slot(handle)]; }
+    MtpObjectHandle parent(MtpObjectHandle handle) const { return page(handle).parent[slot(handle)]; }
+    uint64_t object_size(MtpObjectHandle handle) const { return page(handle).object_size[slot(handle)]; }
+    std::time_t last_modified(MtpObjectHandle handle) const { return page(handle).last_modified[slot(handle)]; }
+    std::time_t date_created(MtpObjectHandle handle) const { return page(handle).date_created[slot(handle)]; }
+    int watch_fd(MtpObjectHandle handle) const { return page(handle).watch_fd[slot(handle)]; }
+    bool listed(MtpObjectHandle handle) const { return !page(handle).unlisted[slot(handle)]; }
+    bool sniffed(MtpObjectHandle handle) const { return !page(handle).unsniffed[slot(handle)]; }
+
+    size_t name_length(MtpObjectHandle handle) const { return page(handle).name_length[slot(handle)]; }
+
+    // name and dates of an object as MTP strings, encoded on first use
+    EncodedStrings encoded(MtpObjectHandle handle) const;
+
+    std::string name(MtpObjectHandle handle) const
+    {
+        const Page& p = page(handle);
+        size_t i = slot(handle);
+
+        return std::string(p.arena, p.name_offset[i], p.name_length[i]);
+    }
+
+    // absolute file system path of an object
+    std::string path(MtpObjectHandle handle) const
+    {
+        RootMap::const_iterator root;
+        std::vector<MtpObjectHandle> chain;
+        MtpObjectHandle current = handle;
+        std::string result;
+
+        root = roots->find(storage_id(handle));
+        if (root == roots->end())
+            throw std::out_of_range("object is not on a known storage");
+
+        /* Objects at the root of a hidden storage directory have no parent
+         * object, every other chain ends at the storage's directory.
+         */
+        while (current != root->second.first) {
+            MtpObjectHandle up = parent(current);
+
+            chain.push_back(current);
+            if (up == 0 || up == MTP_PARENT_ROOT)
+                break;
+            if (chain.size() > count)
+                throw std::logic_error("loop in object hierarchy");
+            current = up;
+        }
+
+        result = root->second.second;
+        for (std::vector<MtpObjectHandle>::reverse_iterator it = chain.rbegin();
+             it != chain.rend();
+             ++it) {
+            const Page& p = page(*it);
+            size_t i = slot(*it);
+
+            result += '/';
+            result.append(p.arena, p.name_offset[i], p.name_length[i]);
+        }
+
+        return result;
+    }
+
+
+    void set_object_format(MtpObjectHandle handle, MtpObjectFormat format)
+    {
+        if (object_format(handle) == format)
+            return;
+
+        unlink_format(handle);
+        adjust_count(handle, -1);
+        edit_page(handle).object_format[slot(handle)] = format;
+        adjust_count(handle, 1);
+        link_format(handle);
+    }
+
+    void set_object_size(MtpObjectHandle handle, uint64_t size)
+    {
+        if (object_size(handle) != size)
+            edit_page(handle).object_size[slot(handle)] = size;
+    }
+
+    void set_last_modified(MtpObjectHandle handle, std::time_t modified)
+    {
+        if (last_modified(handle) == modified)
+            return;
+
+        Page& p = edit_page(handle);
+
+        p.last_modified[slot(handle)] = modified;
+        p.stamp[slot(handle)]++;
+    }
+
+    void set_date_created(MtpObjectHandle handle, std::time_t created)
+    {
+        if (date_created(handle) == created)
+            return;
+
+        Page& p = edit_page(handle);
+
+        p.date_created[slot(handle)] = created;
+        p.stamp[slot(handle)]++;
+    }
+
+    void set_listed(MtpObjectHandle handle, bool listed)
+    {
+        if (this->listed(handle) != listed)
+            edit_page(handle).unlisted[slot(handle)] = !listed;
+    }
+
+    void set_sniffed(MtpObjectHandle handle, bool sniffed)
+    {
+        if (this->sniffed(handle) == sniffed)
+            return;
+
+        adjust_count(handle, -1);
+        edit_page(handle).unsniffed[slot(handle)] = !sniffed;
+        adjust_count(handle, 1);
+    }
+
+    // any watch id is kept, only descriptors are indexed
+    void set_watch_fd(MtpObjectHandle handle, int wd)
+    {
+        unwatch(handle);
+        edit_page(handle).watch_fd[slot(handle)] = wd;
+        if (wd >= 0)
+            edit(watches, wd)[wd] = handle;
+    }
+
+    void insert(MtpObjectHandle handle, const DbEntry& entry)
+    {
+        size_t index = page_index(handle);
+        size_t i = slot(handle);
+
+        if ((handle & ~kHandleMask) != prefix)
+            throw std::out_of_range("object handle belongs to another store");
+
+        if (contains(handle))
+            erase(handle);
+
+        dirty = true;
+        if (index >= pages.size())
+            pages.resize(index + 1);
+        if (!pages[index])
+            pages[index] = std::make_shared<Page>(generation);
+        else if (pages[index]->generation != generation) {
+            pages[index] = std::make_shared<Page>(*pages[index]);
+            pages[index]->generation = generation;
+        }
+
+        Page& p = *pages[index];
+
+        p.storage_id[i] = entry.storage_id;
+        p.object_format[i] = entry.object_format;
+        p.parent[i] = entry.parent;
+        p.object_size[i] = entry.object_size;
+        p.last_modified[i] = entry.last_modified;
+        p.date_created[i] = entry.date_created;
+        p.watch_fd[i] = -1;
+        set_name(p, i, entry.display_name);
+        p.unlisted[i] = false;
+        p.unsniffed[i] = false;
+        p.live[i] = true;
+        count++;
+
+        link_child(handle);
+        link_format(handle);
+
+        if (entry.object_format == MTP_FORMAT_ASSOCIATION)
+            set_watch_fd(handle, entry.watch_fd);
+    }
+
+    // removes a single object; its children are left to the caller
+    void erase(MtpObjectHandle handle)
+    {
+        if (!contains(handle))
+            return;
+
+        unlink_child(handle);
+        clear_slot(handle);
+    }
+
+    void reparent(MtpObjectHandle handle, MtpObjectHandle new_parent)
+    {
+        unlink_child(handle);
+        edit_page(handle).parent[slot(handle)] = new_parent;
+        link_child(handle);
+    }
+
+    void rename(MtpObjectHandle handle, const std::string& name)
+    {
+        size_t i = slot(handle);
+
+        unlink_child(handle);
+
+        Page& p = edit_page(handle);
+
+        release_name(p, i);
+        set_name(p, i, name);
+        link_child(handle);
+    }
+
+    const HandleList* children_of(MtpStorageID storage, MtpObjectHandle parent) const
+    {
+        ChildKey key(storage, parent);
+        const ChildMap& bucket = children.get(child_hash(key));
+        ChildMap::const_iterator it;
+
+        it = bucket.find(key);
+        return it == bucket.end() ? nullptr : &it->second;
+    }
+
+    /* Hands the listing under a parent over to the caller, used when the
+     * whole listing is about to go away.
+     */
+    void detach_children(MtpStorageID storage, MtpObjectHandle parent, HandleList& out)
+    {
+        ChildKey key(storage, parent);
+        ChildMap& bucket = edit(children, child_hash(key));
+        ChildMap::iterator it;
+
+        out.clear();
+        it = bucket.find(key);
+        if (it == bucket.end())
+            return;
+
+        out.swap(it->second);
+        bucket.erase(it);
+    }
+
+    // number of objects of a format in a listing
+    size_t count_children(MtpStorageID storage, MtpObjectHandle parent, MtpObjectFormat format) const
+    {
+        CountKey key(storage, parent, format);
+        const CountMap& bucket = counts.get(count_hash(key));
+        CountMap::const_iterator it;
+
+        it = bucket.find(key);
+        return it == bucket.end() ? 0 : it->second.objects;
+    }
+
+    // files in a listing whose format is still to be read from their contents
+    size_t unsniffed_children(MtpStorageID storage, MtpObjectHandle parent) const
+    {
+        CountKey key(storage, parent, MTP_FORMAT_UNDEFINED);
+        const CountMap& bucket = counts.get(count_hash(key));
+        CountMap::const_iterator it;
+
+        it = bucket.find(key);
+        return it == bucket.end() ? 0 : it->second.unsniffed;
+    }
+
+    MtpObjectHandle find_name(MtpStorageID storage,
+                              MtpObjectHandle parent,
+                              const std::string& name) const
+    {
+        std::size_t hash = name_hash(storage, parent, name.data(), name.size());
+        std::pair<NameMap::const_iterator, NameMap::const_iterator> range;
+
+        range = names.get(hash).equal_range(hash);
+        for (; range.first != range.second; ++range.first) {
+            MtpObjectHandle handle = range.first->second;
+            const Page& p = page(handle);
+            size_t i = slot(handle);
+
+            if (p.storage_id[i] == storage && p.parent[i] == parent
+                    && p.name_length[i] == name.size()
+                    && name.compare(0, name.size(), p.arena, p.name_offset[i], p.name_length[i]) == 0)
+                return handle;
+        }
+
+        return 0;
+    }
+
+    // every object of a format on a storage, in handle order
+    HandleList with_format(MtpStorageID storage, MtpObjectFormat format) const
+    {
+        std::vector<const HandleList*> lists = format_lists(storage, format);
+        HandleList result;
+
+        for (size_t i = 0; i < lists.size(); i++)
+            result.insert(result.end(), lists[i]->begin(), lists[i]->end());
+
+        return result;
+    }
+
+    // number of objects of a format on a storage
+    size_t count_format(MtpStorageID storage, MtpObjectFormat format) const
+    {
+        MtpObjectHandle any = kAnyParent;
+
+        return count_children(storage, any, format);
+    }
+
+    MtpObjectHandle find_watch(int wd) const
+    {
+        WatchMap::const_iterator it;
+
+        it = watches.get(wd).find(wd);
+        return it == watches.get(wd).end() ? 0 : it->second;
+    }
+
+    // watch descriptors of all watched directories
+    std::vector<int> watch_fds() const
+    {
+        std::vector<int> result;
+
+        for (size_t b = 0; b < kIndexBuckets; b++) {
+            for (WatchMap::const_iterator it = watches.get(b).begin(); it != watches.get(b).end(); ++it)
+                result.push_back(it->first);
+        }
+
+        return result;
+    }
+
+    void add_storage(MtpStorageID storage, MtpObjectHandle handle, const std::string& path)
+    {
+        std::shared_ptr<RootMap> updated = std::make_shared<RootMap>(*roots);
+
+        (*updated)[storage] = std::make_pair(handle, path);
+        roots = updated;
+        dirty = true;
+    }
+
+    // handle of a storage's top-level directory, 0 if there is none
+    MtpObjectHandle root(MtpStorageID storage) const
+    {
+        RootMap::const_iterator it = roots->find(storage);
+
+        return it == roots->end() ? 0 : it->second.first;
+    }
+
+    std::string root_path(MtpStorageID storage) const
+    {
+        RootMap::const_iterator it = roots->find(storage);
+
+        return it == roots->end() ? std::string() : it->second.second;
+    }
+
+    std::vector<MtpStorageID> storages() const
+    {
+        std::vector<MtpStorageID> result;
+
+        for (RootMap::const_iterator it = roots->begin(); it != roots->end(); ++it)
+            result.push_back(it->first);
+
+        return result;
+    }
+};
+
+// an object's strings in an encoding of its page, which they keep alive
+class ObjectStore::EncodedStrings
+{
+private:
+    std::shared_ptr<const Encoding> encoding;
+    size_t i;
+
+public:
+    EncodedStrings(const std::shared_ptr<const Encoding>& encoding, size_t i) :
+        encoding(encoding), i(i) {}
+
+    // the name followed by the dates created and modified
+    const uint8_t* data() const
+    {
+        return reinterpret_cast<const uint8_t*>(encoding->data.data()) + encoding->offset[i];
+    }
+
+    size_t size() const { return name_size() + date_created_size() + last_modified_size(); }
+
+    const uint8_t* name() const { return data(); }
+    size_t name_size() const { return encoding->name_size[i]; }
+    const uint8_t* date_created() const { return name() + name_size(); }
+    size_t date_created_size() const { return encoding->date_size[i][0]; }
+    const uint8_t* last_modified() const { return date_created() + date_created_size(); }
+    size_t last_modified_size() const { return encoding->date_size[i][1]; }
+};
+
+inline ObjectStore::EncodedStrings ObjectStore::encoded(MtpObjectHandle handle) const
+{
+    const Page& p = page(handle);
+    size_t i = slot(handle);
+    std::shared_ptr<const Encoding> encoding = p.encoded.load();
+
+    // concurrent readers may both encode a page, either result will do
+    if (!encoding || encoding->stamp[i] != p.stamp[i]) {
+        encoding = encode_page(p, encoding.get());
+        p.encoded.store(encoding);
+    }
+
+    return EncodedStrings(encoding, i);
+}
+}
+
+#endif // DROIDIAN_OBJECT_STORE_H_
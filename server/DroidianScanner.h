@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DROIDIAN_SCANNER_H_
+#define DROIDIAN_SCANNER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <boost/bind/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <glog/logging.h>
+
+namespace android
+{
+// a file or directory as found on disk, children sorted by name
+struct ScanNode
+{
+    std::string name;
+    bool directory;
+    uint64_t size;
+    std::time_t last_modified;
+    std::time_t date_created;
+    int watch_fd;
+    std::vector<ScanNode> children;
+
+    ScanNode() : directory(false), size(0), last_modified(0), date_created(0), watch_fd(-1) {}
+
+    bool operator<(const ScanNode& other) const { return name < other.name; }
+};
+
+/* Walks a directory tree with one worker per core, so that several
+ * directory reads are in flight at once.
+ *
+ * Each worker has its own deque of directories to read. It takes the
+ * newest from its own deque and, when that runs dry, steals the oldest
+ * from the others; the walk is over once no directory is pending. The
+ * result is a tree in a fixed order, independent of how the work was
+ * spread, which the caller merges into the database.
+ *
+ * Directories are watched before they are read, so nothing created in
+ * the meantime is missed. Their entries are listed with getdents64 and
+ * looked up relative to the open directory, so no path is resolved
+ * from the root once per file. A scanner runs one walk at a time.
+ */
+class DirectoryScanner
+{
+public:
+    typedef boost::function<int (const boost::filesystem::path&)> WatchFunction;
+
+private:
+    struct Task
+    {
+        ScanNode* node;
+        boost::filesystem::path path;
+    };
+
+    static const size_t kDirentBuffer = 32 * 1024;
+
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    WatchFunction watch;
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::atomic<size_t> pending;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+
+    void push(size_t worker, const Task& task)
+    {
+        pending++;
+
+        {
+            std::lock_guard<std::mutex> lock(workers[worker]->lock);
+            workers[worker]->tasks.push_back(task);
+        }
+
+        idle.notify_one();
+    }
+
+    bool pop(size_t worker, Task& task)
+    {
+        {
+            Worker& own = *workers[worker];
+            std::lock_guard<std::mutex> lock(own.lock);
+
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < workers.size(); i++) {
+            Worker& victim = *workers[(worker + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.lock);
+
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void run(size_t worker)
+    {
+        Task task;
+
+        while (pending > 0) {
+            if (!pop(worker, task)) {
+                std::unique_lock<std::mutex> lock(idle_lock);
+
+                idle.wait_for(lock, std::chrono::milliseconds(1));
+                continue;
+            }
+
+            read_directory(worker, task);
+
+            if (--pending == 0)
+                idle.notify_all();
+        }
+    }
+
+    // reads the entries of a directory into node, sorted by name
+    static bool read_entries(const boost::filesystem::path& path, ScanNode& node)
+    {
+        std::vector<char> buffer(kDirentBuffer);
+        int fd;
+
+        fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 && errno == EACCES) {
+            VLOG(2) << "Could not immediately read dir; retrying.";
+            boost::this_thread::sleep(boost::posix_time::millisec(500));
+            fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+
+        if (fd < 0) {
+            PLOG(WARNING) << "Could not read " << path;
+            return false;
+        }
+
+        for (;;) {
+            long length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+
+            if (length < 0)
+                PLOG(WARNING) << "Could not read " << path;
+            if (length <= 0)
+                break;
+
+            for (long offset = 0; offset < length; ) {
+                const struct dirent64* entry
+                    = reinterpret_cast<const struct dirent64*>(&buffer[offset]);
+                ScanNode child;
+
+                offset += entry->d_reclen;
+
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                    continue;
+
+                // pipes, sockets and device nodes aren't objects, skip the stat
+                if (entry->d_type != DT_DIR && entry->d_type != DT_REG
+                        && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+                    continue;
+
+                child.name = entry->d_name;
+                if (stat_entry(fd, entry->d_name, child))
+                    node.children.push_back(std::move(child));
+            }
+        }
+
+        close(fd);
+
+        std::sort(node.children.begin(), node.children.end());
+        return true;
+    }
+
+    void read_directory(size_t worker, const Task& task)
+    {
+        ScanNode& node = *task.node;
+
+        node.watch_fd = watch(task.path);
+        read_entries(task.path, node);
+
+        // the children are in place now, hand out their directories
+        for (std::vector<ScanNode>::iterator it = node.children.begin();
+             it != node.children.end();
+             ++it) {
+            if (it->directory) {
+                Task next = { &*it, task.path / it->name };
+                push(worker, next);
+            }
+        }
+    }
+
+public:
+    explicit DirectoryScanner(const WatchFunction& watch) :
+        watch(watch),
+        pending(0)
+    {
+    }
+
+    /* Fills in the type, size and times of path, which is relative to
+     * dirfd unless absolute. Only directories and regular files are
+     * accepted, symbolic links are followed.
+     */
+    static bool stat_entry(int dirfd, const char* path, ScanNode& node)
+    {
+        struct stat st;
+
+#ifdef STATX_BTIME
+        struct statx stx;
+
+        if (statx(dirfd, path, 0,
+                  STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_BTIME,
+                  &stx) == 0) {
+            if (!S_ISDIR(stx.stx_mode) && !S_ISREG(stx.stx_mode))
+                return false;
+
+            node.directory = S_ISDIR(stx.stx_mode);
+            node.size = node.directory ? 0 : stx.stx_size;
+            node.last_modified = stx.stx_mtime.tv_sec;
+            // not every file system records a birth time
+            node.date_created = stx.stx_mask & STATX_BTIME ? stx.stx_btime.tv_sec : 0;
+            return true;
+        }
+
+        if (errno != ENOSYS) {
+            PLOG(WARNING) << "There was an error reading file properties";
+            return false;
+        }
+#endif
+
+        if (fstatat(dirfd, path, &st, 0) != 0) {
+            PLOG(WARNING) << "There was an error reading file properties";
+            return false;
+        }
+
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+            return false;
+
+        node.directory = S_ISDIR(st.st_mode);
+        node.size = node.directory ? 0 : st.st_size;
+        node.last_modified = st.st_mtime;
+        node.date_created = 0;
+        return true;
+    }
+
+    // reads p and the entries directly below it, without watching it
+    static bool list(const boost::filesystem::path& p, ScanNode& node)
+    {
+        node.name = p.filename().string();
+        if (!stat_entry(AT_FDCWD, p.c_str(), node) || !node.directory)
+            return false;
+
+        return read_entries(p, node);
+    }
+
+    // scans p and, if it is a directory, everything below it
+    bool scan(const boost::filesystem::path& p, ScanNode& root)
+    {
+        boost::thread_group threads;
+        size_t count = std::max(1u, boost::thread::hardware_concurrency());
+        Task task = { &root, p };
+
+        root.name = p.filename().string();
+        if (!stat_entry(AT_FDCWD, p.c_str(), root))
+            return false;
+
+        if (!root.directory)
+            return true;
+
+        workers.clear();
+        for (size_t i = 0; i < count; i++)
+            workers.push_back(std::unique_ptr<Worker>(new Worker()));
+
+        // most directories created at runtime have no subdirectories, so
+        // only start the pool once the top level has been read
+        pending = 1;
+        read_directory(0, task);
+        if (--pending == 0)
+            return true;
+
+        for (size_t i = 1; i < count; i++)
+            threads.create_thread(boost::bind(&DirectoryScanner::run, this, i));
+
+        run(0);
+        threads.join_all();
+
+        return true;
+    }
+};
+}
+
+#endif // DROIDIAN_SCANNER_H_
@@ -0,0 +1,528 @@
+/*
+ * Copyright (C) 2013 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DROIDIAN_WATCHER_H_
+#define DROIDIAN_WATCHER_H_
+
+#include <climits>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/function.hpp>
+
+#include <glog/logging.h>
+
+namespace android
+{
+/* A change to a directory entry, in inotify's terms: mask holds IN_*
+ * bits and moves are paired by cookie. The directory is given either by
+ * the watch descriptor it was added with or, for watchers that cover a
+ * whole storage, by its absolute path.
+ */
+struct WatchEvent
+{
+    int wd;
+    std::string directory;
+    std::string name;
+    uint32_t mask;
+    uint32_t cookie;
+
+    WatchEvent() : wd(-1), mask(0), cookie(0) {}
+};
+
+/* Source of file system change events for the database.
+ *
+ * Directories are watched one by one, unless the watcher covers the
+ * whole storage they are on, in which case they need no watch of their
+ * own. Events are handed over in batches on the io_service's thread.
+ */
+class Watcher
+{
+public:
+    typedef boost::function<void (const std::vector<WatchEvent>&)> Handler;
+
+    // watch id of a directory that couldn't be watched
+    static const int kNoWatch = -1;
+    // watch id of a directory that is covered by its storage's watch
+    static const int kCovered = -2;
+
+    // whether changes to a directory with this watch id are reported
+    static bool watched(int wd) { return wd >= 0 || wd == kCovered; }
+    // whether the id is a descriptor of the directory's own, events name it
+    static bool has_descriptor(int wd) { return wd >= 0; }
+
+    virtual ~Watcher() {}
+
+    virtual void start(const Handler& handler) = 0;
+
+    // returns true if everything below root is watched from now on
+    virtual bool add_storage(const std::string& /*root*/) { return false; }
+    virtual void remove_storage(const std::string& /*root*/) {}
+
+    // may be called from several threads at once
+    virtual int add_directory(const std::string& path) = 0;
+    virtual void remove_directory(int wd) = 0;
+
+    // picks the best watcher the system lets us use
+    static std::unique_ptr<Watcher> create(boost::asio::io_service& io_svc);
+
+protected:
+    // large enough for a few hundred events with long names
+    static const size_t kEventBuffer = 64 * 1024;
+};
+
+// one inotify watch per directory
+class InotifyWatcher : public Watcher
+{
+private:
+    static const uint32_t kMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+
+    int fd;
+    boost::asio::posix::stream_descriptor stream;
+    std::vector<char> buffer;
+    Handler handler;
+
+    void read_more()
+    {
+        stream.async_read_some(boost::asio::buffer(buffer),
+                               boost::bind(&InotifyWatcher::read_handler,
+                                           this,
+                                           boost::asio::placeholders::error,
+                                           boost::asio::placeholders::bytes_transferred));
+    }
+
+    void read_handler(const boost::system::error_code& error, std::size_t transferred)
+    {
+        std::vector<WatchEvent> events;
+        size_t processed = 0;
+
+        if (error) {
+            if (error != boost::asio::error::operation_aborted)
+                LOG(ERROR) << "Could not read file system events: " << error.message();
+            return;
+        }
+
+        while (transferred - processed >= sizeof(inotify_event)) {
+            const inotify_event* ievent = reinterpret_cast<const inotify_event*>(&buffer[processed]);
+            WatchEvent event;
+
+            processed += sizeof(inotify_event) + ievent->len;
+
+            event.wd = ievent->wd;
+            event.mask = ievent->mask;
+            event.cookie = ievent->cookie;
+            if (ievent->len > 0)
+                event.name = ievent->name;
+
+            events.push_back(event);
+        }
+
+        handler(events);
+
+        read_more();
+    }
+
+public:
+    explicit InotifyWatcher(boost::asio::io_service& io_svc) :
+        fd(inotify_init1(IN_CLOEXEC)),
+        stream(io_svc),
+        buffer(kEventBuffer)
+    {
+        if (fd < 0)
+            PLOG(FATAL) << "Invalid file descriptor to inotify";
+        VLOG(1) << "using inotify fd " << fd << " for database";
+
+        stream.assign(fd);
+    }
+
+    virtual void start(const Handler& handler)
+    {
+        this->handler = handler;
+        read_more();
+    }
+
+    virtual int add_directory(const std::string& path)
+    {
+        return inotify_add_watch(fd, path.c_str(), kMask);
+    }
+
+    virtual void remove_directory(int wd)
+    {
+        if (wd >= 0)
+            inotify_rm_watch(fd, wd);
+    }
+};
+
+/* One fanotify mark per file system, reporting the directory and name
+ * of each change, so the cost doesn't grow with the number of
+ * directories. Marking a whole file system needs CAP_SYS_ADMIN; storages
+ * that can't be marked are watched through inotify instead.
+ *
+ * The mark sees every change on the file system, those outside of the
+ * storages are dropped once their directory has been resolved.
+ */
+class FanotifyWatcher : public Watcher
+{
+private:
+    struct Mark
+    {
+        // the storage's directory as the database knows it
+        std::string root;
+        // and with symbolic links resolved, as events are reported
+        std::string real;
+        dev_t device;
+        __kernel_fsid_t fsid;
+        // any descriptor on the file system, for open_by_handle_at
+        int mount_fd;
+    };
+
+    // resolved directories kept at most
+    static const size_t kDirectoryCache = 4096;
+
+    int fd;
+    boost::asio::posix::stream_descriptor stream;
+    std::vector<char> buffer;
+    Handler handler;
+    InotifyWatcher fallback;
+    uint64_t mask;
+    uint32_t next_cookie;
+
+    std::mutex lock;
+    std::vector<Mark> marks;
+    // file handle -> absolute path, only used from the io_service thread
+    std::unordered_map<std::string, std::string> directories;
+
+    static bool below(const std::string& path, const std::string& root)
+    {
+        return path.compare(0, root.size(), root) == 0
+            && (path.size() == root.size() || path[root.size()] == '/');
+    }
+
+    bool covers(const std::string& path) const
+    {
+        for (size_t i = 0; i < marks.size(); i++) {
+            if (below(path, marks[i].root))
+                return true;
+        }
+
+        return false;
+    }
+
+    // a resolved path below a storage, rebased on its root, empty if none
+    std::string rebase(const std::string& path) const
+    {
+        for (size_t i = 0; i < marks.size(); i++) {
+            if (below(path, marks[i].real))
+                return marks[i].root + path.substr(marks[i].real.size());
+        }
+
+        return std::string();
+    }
+
+    // path of the directory a file handle refers to, empty if not on a storage
+    std::string resolve(const struct fanotify_event_info_fid* fid)
+    {
+        const struct file_handle* handle = reinterpret_cast<const struct file_handle*>(fid->handle);
+        size_t length = sizeof(struct file_handle) + handle->handle_bytes;
+        std::string key(reinterpret_cast<const char*>(&fid->fsid), sizeof(fid->fsid));
+        std::unordered_map<std::string, std::string>::const_iterator it;
+        std::vector<char> copy(length);
+        char link[32];
+        char target[PATH_MAX];
+        ssize_t size;
+        int dir = -1;
+
+        key.append(reinterpret_cast<const char*>(handle), length);
+        it = directories.find(key);
+        if (it != directories.end())
+            return it->second;
+
+        memcpy(copy.data(), handle, length);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            for (size_t i = 0; i < marks.size() && dir < 0; i++) {
+                if (memcmp(&marks[i].fsid, &fid->fsid, sizeof(fid->fsid)) == 0)
+                    dir = open_by_handle_at(marks[i].mount_fd,
+                                            reinterpret_cast<struct file_handle*>(copy.data()),
+                                            O_PATH | O_CLOEXEC);
+            }
+        }
+
+        // the directory may be gone already
+        if (dir < 0)
+            return std::string();
+
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", dir);
+        size = readlink(link, target, sizeof(target));
+        close(dir);
+        if (size <= 0)
+            return std::string();
+
+        std::string path;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            path = rebase(std::string(target, size));
+        }
+
+        if (directories.size() >= kDirectoryCache)
+            directories.clear();
+        directories[key] = path;
+
+        return path;
+    }
+
+    void read_more()
+    {
+        stream.async_read_some(boost::asio::buffer(buffer),
+                               boost::bind(&FanotifyWatcher::read_handler,
+                                           this,
+                                           boost::asio::placeholders::error,
+                                           boost::asio::placeholders::bytes_transferred));
+    }
+
+    void read_handler(const boost::system::error_code& error, std::size_t transferred)
+    {
+        std::vector<WatchEvent> events;
+        const struct fanotify_event_metadata* meta;
+        size_t length = transferred;
+
+        if (error) {
+            if (error != boost::asio::error::operation_aborted)
+                LOG(ERROR) << "Could not read file system events: " << error.message();
+            return;
+        }
+
+        for (meta = reinterpret_cast<const struct fanotify_event_metadata*>(buffer.data());
+             FAN_EVENT_OK(meta, length);
+             meta = FAN_EVENT_NEXT(meta, length)) {
+            const char* info = reinterpret_cast<const char*>(meta) + meta->metadata_len;
+            const char* end = reinterpret_cast<const char*>(meta) + meta->event_len;
+            uint32_t cookie = 0;
+
+            if (meta->fd >= 0)
+                close(meta->fd);
+
+            if (meta->mask & FAN_Q_OVERFLOW) {
+                WatchEvent event;
+
+                event.mask = IN_Q_OVERFLOW;
+                events.push_back(event);
+                continue;
+            }
+
+            // a directory moved or deleted takes the paths below it along
+            if (meta->mask & FAN_ONDIR && meta->mask & (FAN_DELETE | FAN_MOVED_FROM | FAN_RENAME))
+                directories.clear();
+
+            /* A rename carries both names and pairs up by itself. Without
+             * FAN_RENAME the two halves come as separate events that can't
+             * be matched, they get cookies of their own so that they end
+             * up as a removal and a creation.
+             */
+            if (meta->mask & (FAN_RENAME | FAN_MOVED_FROM | FAN_MOVED_TO))
+                cookie = ++next_cookie;
+
+            while (info + sizeof(struct fanotify_event_info_header) <= end) {
+                const struct fanotify_event_info_header* header
+                    = reinterpret_cast<const struct fanotify_event_info_header*>(info);
+                const struct fanotify_event_info_fid* fid
+                    = reinterpret_cast<const struct fanotify_event_info_fid*>(info);
+                WatchEvent event;
+
+                if (header->len == 0)
+                    break;
+                info += header->len;
+
+                // the fanotify bits have the values of their inotify counterparts
+                switch (header->info_type) {
+                    case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                        event.mask = meta->mask & (FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE
+                                                   | FAN_MOVED_FROM | FAN_MOVED_TO);
+                        break;
+                    case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME: event.mask = IN_MOVED_FROM; break;
+                    case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME: event.mask = IN_MOVED_TO; break;
+                    default: continue;
+                }
+
+                event.cookie = cookie;
+                event.directory = resolve(fid);
+                event.name = reinterpret_cast<const char*>(fid->handle)
+                    + sizeof(struct file_handle)
+                    + reinterpret_cast<const struct file_handle*>(fid->handle)->handle_bytes;
+
+                if (event.mask != 0 && !event.directory.empty())
+                    events.push_back(event);
+            }
+        }
+
+        if (!events.empty())
+            handler(events);
+
+        read_more();
+    }
+
+public:
+    FanotifyWatcher(boost::asio::io_service& io_svc, int fd) :
+        fd(fd),
+        stream(io_svc),
+        buffer(kEventBuffer),
+        fallback(io_svc),
+        mask(FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE | FAN_RENAME | FAN_ONDIR),
+        next_cookie(0)
+    {
+        VLOG(1) << "using fanotify fd " << fd << " for database";
+
+        stream.assign(fd);
+    }
+
+    virtual ~FanotifyWatcher()
+    {
+        for (size_t i = 0; i < marks.size(); i++)
+            close(marks[i].mount_fd);
+    }
+
+    virtual void start(const Handler& handler)
+    {
+        this->handler = handler;
+        fallback.start(handler);
+        read_more();
+    }
+
+    virtual bool add_storage(const std::string& root)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        struct statfs fs;
+        struct stat st;
+        char real[PATH_MAX];
+        bool marked = false;
+        Mark mark;
+
+        if (stat(root.c_str(), &st) != 0 || statfs(root.c_str(), &fs) != 0
+                || !realpath(root.c_str(), real))
+            return false;
+
+        for (size_t i = 0; i < marks.size(); i++)
+            marked = marked || marks[i].device == st.st_dev;
+
+        if (!marked) {
+            int result = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, root.c_str());
+
+            // renames are only reported whole since Linux 5.17
+            if (result != 0 && errno == EINVAL && mask & FAN_RENAME) {
+                mask = (mask & ~FAN_RENAME) | FAN_MOVED_FROM | FAN_MOVED_TO;
+                result = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, root.c_str());
+            }
+
+            if (result != 0) {
+                PLOG(INFO) << "Could not mark the file system of " << root
+                           << ", watching its directories instead";
+                return false;
+            }
+        }
+
+        mark.root = root;
+        mark.real = real;
+        mark.device = st.st_dev;
+        memcpy(&mark.fsid, &fs.f_fsid, sizeof(mark.fsid));
+        // open_by_handle_at() doesn't accept O_PATH descriptors
+        mark.mount_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (mark.mount_fd < 0) {
+            PLOG(WARNING) << "Could not open " << root;
+            return false;
+        }
+        marks.push_back(mark);
+
+        VLOG(1) << "watching " << root << " through its file system";
+        return true;
+    }
+
+    virtual void remove_storage(const std::string& root)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        dev_t device = 0;
+        bool shared = false;
+
+        for (std::vector<Mark>::iterator it = marks.begin(); it != marks.end(); ) {
+            if (it->root == root) {
+                device = it->device;
+                close(it->mount_fd);
+                it = marks.erase(it);
+            } else
+                ++it;
+        }
+
+        for (size_t i = 0; i < marks.size(); i++)
+            shared = shared || marks[i].device == device;
+
+        // the file system may be gone already, which drops the mark too
+        if (device != 0 && !shared)
+            fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, root.c_str());
+    }
+
+    virtual int add_directory(const std::string& path)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            if (covers(path))
+                return kCovered;
+        }
+
+        return fallback.add_directory(path);
+    }
+
+    virtual void remove_directory(int wd)
+    {
+        fallback.remove_directory(wd);
+    }
+};
+
+inline std::unique_ptr<Watcher> Watcher::create(boost::asio::io_service& io_svc)
+{
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+                           O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        VLOG(1) << "fanotify is not available, using inotify";
+        return std::unique_ptr<Watcher>(new InotifyWatcher(io_svc));
+    }
+
+    return std::unique_ptr<Watcher>(new FanotifyWatcher(io_svc, fd));
+}
+}
+
+#endif // DROIDIAN_WATCHER_H_
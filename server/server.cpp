@@ -21,10 +21,13 @@
 #include <MtpStorage.h>
 
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <thread>
 #include <stdint.h>
 
+#include <pthread.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -70,6 +73,10 @@ private:
     asio::io_service::work work;
     asio::posix::stream_descriptor stream_desc;
     asio::streambuf buf;
+    asio::signal_set signals;
+
+    // the thread serving the host, the only one that takes SIGINT and SIGTERM
+    pthread_t main_thread;
 
     int inotify_fd;
 
@@ -77,13 +84,16 @@ private:
     int media_fd;
 
     // storage
-    std::map<std::string, std::tuple<MtpStorage*, bool> > removables;
+    std::map<std::string, MtpStorage*> removables;
     bool home_storage_added;
 
     void add_removable_storage(const char *path, const char *name)
     {
         static int storageID = MTP_STORAGE_REMOVABLE_RAM;
 
+        // a card mounted again under the same name replaces the old one
+        remove_removable_storage(name);
+
         /* TODO check removable file system type to set maximum file size */
         MtpStorage *removable = new MtpStorage(
             storageID,
@@ -95,15 +105,37 @@ private:
 
         storageID++;
 
+        /* Only the top level is read here, the database indexes the rest
+         * of the card in the background while the host can already
+         * browse it.
+         */
         mtp_database->addStoragePath(path,
                                      std::string(),
                                      removable->getStorageID(),
                                      true);
         server->addStorage(removable);
 
-        removables.insert(std::pair<std::string, std::tuple<MtpStorage*, bool> >
-                              (name,
-                               std::make_tuple(removable, false)));
+        removables[name] = removable;
+    }
+
+    void remove_removable_storage(const std::string& name)
+    {
+        std::map<std::string, MtpStorage*>::iterator it;
+        MtpStorage *storage;
+
+        it = removables.find(name);
+        if (it == removables.end())
+            return;
+
+        storage = it->second;
+        removables.erase(it);
+
+        VLOG(2) << "removing storage id " << storage->getStorageID();
+
+        // waits for the request being handled, nothing refers to it afterwards
+        server->removeStorage(storage);
+        mtp_database->removeStorage(storage->getStorageID());
+        delete storage;
     }
 
     void add_mountpoint_watch(const std::string& path)
@@ -125,11 +157,14 @@ private:
                                                 asio::placeholders::bytes_transferred));
     }
 
-    void inotify_handler(const boost::system::error_code&,
+    void inotify_handler(const boost::system::error_code& error,
                          std::size_t transferred)
     {
         size_t processed = 0;
 
+        if (error == asio::error::operation_aborted)
+            return;
+
         while(transferred - processed >= sizeof(inotify_event))
         {
             const char* cdata = processed + asio::buffer_cast<const char*>(buf.data());
@@ -155,33 +190,47 @@ private:
             {
                 VLOG(1) << "Storage was removed: " << ievent->name;
 
-                // Try to match to which storage was removed.
-                BOOST_FOREACH(std::string name, removables | boost::adaptors::map_keys) {
-                    if (name == ievent->name) {
-                        auto t = removables.at(name);
-                        MtpStorage *storage = std::get<0>(t);
-
-                        VLOG(2) << "removing storage id "
-                                << storage->getStorageID();
-
-                        server->removeStorage(storage);
-                        mtp_database->removeStorage(storage->getStorageID());
-                    }
-                }
+                remove_removable_storage(ievent->name);
             }
         }
 
         read_more_notify();
     }
 
+    /* Stops the server once the request being handled is done, so that
+     * the daemon is torn down and the database saved on the way out.
+     */
+    void shutdown_handler(const boost::system::error_code& error, int signal_number)
+    {
+        if (error)
+            return;
+
+        LOG(INFO) << "Received signal " << signal_number << ", shutting down";
+
+        // no more storages come or go
+        stream_desc.cancel();
+        server->stop();
+
+        // interrupts the main loop if it is waiting for a request
+        pthread_kill(main_thread, signal_number);
+    }
+
 public:
 
     MtpDaemon(int fd):
         stream_desc(io_svc),
         work(io_svc),
-        buf(1024)
+        buf(1024),
+        signals(io_svc, SIGINT, SIGTERM),
+        main_thread(pthread_self())
     {
         userdata = getpwuid (getuid());
+        home_storage = nullptr;
+
+        signals.async_wait(boost::bind(&MtpDaemon::shutdown_handler,
+                                       this,
+                                       asio::placeholders::error,
+                                       asio::placeholders::signal_number));
 
         // Removable storage hacks
         inotify_fd = inotify_init();
@@ -195,7 +244,10 @@ public:
 
 
         // MTP database.
-        mtp_database = new DroidianMtpDatabase();
+        const char* lazy = getenv("MTP_LAZY_INDEXING");
+        const char* resync = getenv("MTP_RESYNC_INTERVAL");
+        mtp_database = new DroidianMtpDatabase(lazy && strcmp(lazy, "1") == 0,
+                                               resync ? atol(resync) : 60);
 
 
         // MTP server
@@ -251,34 +303,41 @@ public:
 
     ~MtpDaemon()
     {
+        std::map<std::string, MtpStorage*>::iterator it;
+
         // Cleanup
         inotify_rm_watch(inotify_fd, watch_fd);
+        // no storage comes or goes from here on
         io_svc.stop();
         notifier_thread.detach();
         io_service_thread.join();
+
+        delete server;
+        // saves the index of every storage, see ~DroidianMtpDatabase
+        delete mtp_database;
+        delete home_storage;
+        for (it = removables.begin(); it != removables.end(); ++it)
+            delete it->second;
+
         close(inotify_fd);
     }
 
     void run()
     {
+        sigset_t shutdown_signals;
+
         VLOG(2) << "device was unlocked, adding storage";
         if (home_storage && !home_storage_added) {
             server->addStorage(home_storage);
             home_storage_added = true;
         }
 
-        BOOST_FOREACH(std::string name, removables | boost::adaptors::map_keys) {
-            auto t = removables.at(name);
-            MtpStorage *storage = std::get<0>(t);
-            bool added = std::get<1>(t);
-            if (!added) {
-                mtp_database->addStoragePath(storage->getPath(),
-                                                 std::string(),
-                                                 storage->getStorageID(),
-                                                 true);
-                server->addStorage(storage);
-            }
-        };
+        // SIGINT and SIGTERM now interrupt the wait for the next request
+        sigemptyset(&shutdown_signals);
+        sigaddset(&shutdown_signals, SIGINT);
+        sigaddset(&shutdown_signals, SIGTERM);
+        pthread_sigmask(SIG_UNBLOCK, &shutdown_signals, nullptr);
+
         // start the MtpServer main loop
         server->run();
     }
@@ -286,6 +345,8 @@ public:
 
 int main(int argc, char** argv)
 {
+    sigset_t shutdown_signals;
+
     google::InitGoogleLogging(argv[0]);
 
     LOG(INFO) << "MTP server starting...";
@@ -297,6 +358,14 @@ int main(int argc, char** argv)
         fd = open("/dev/mtp_usb", O_RDWR);
     }
 
+    /* Blocked here so that every thread started from now on leaves them to
+     * the main one, see MtpDaemon::run.
+     */
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+
     try {
         MtpDaemon *d = new MtpDaemon(fd);
 
@@ -16,6 +16,7 @@
 
 #define LOG_TAG "MtpDataPacket"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 
@@ -331,24 +332,28 @@ void MtpDataPacket::putUInt128(uint64_t value) {
 }
 
 void MtpDataPacket::putAInt8(const int8_t* values, int count) {
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(int8_t));
     putUInt32(count);
     for (int i = 0; i < count; i++)
         putInt8(*values++);
 }
 
 void MtpDataPacket::putAUInt8(const uint8_t* values, int count) {
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(uint8_t));
     putUInt32(count);
     for (int i = 0; i < count; i++)
         putUInt8(*values++);
 }
 
 void MtpDataPacket::putAInt16(const int16_t* values, int count) {
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(int16_t));
     putUInt32(count);
     for (int i = 0; i < count; i++)
         putInt16(*values++);
 }
 
 void MtpDataPacket::putAUInt16(const uint16_t* values, int count) {
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(uint16_t));
     putUInt32(count);
     for (int i = 0; i < count; i++)
         putUInt16(*values++);
@@ -356,18 +361,21 @@ void MtpDataPacket::putAUInt16(const uint16_t* values, int count) {
 
 void MtpDataPacket::putAUInt16(const UInt16List* values) {
     size_t count = (values ? values->size() : 0);
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(uint16_t));
     putUInt32(count);
     for (size_t i = 0; i < count; i++)
         putUInt16((*values)[i]);
 }
 
 void MtpDataPacket::putAInt32(const int32_t* values, int count) {
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(int32_t));
     putUInt32(count);
     for (int i = 0; i < count; i++)
         putInt32(*values++);
 }
 
 void MtpDataPacket::putAUInt32(const uint32_t* values, int count) {
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(uint32_t));
     putUInt32(count);
     for (int i = 0; i < count; i++)
         putUInt32(*values++);
@@ -378,6 +386,7 @@ void MtpDataPacket::putAUInt32(const UInt32List* list) {
         putEmptyArray();
     } else {
         size_t size = list->size();
+        allocate(mOffset + sizeof(uint32_t) + size * sizeof(uint32_t));
         putUInt32(size);
         for (size_t i = 0; i < size; i++)
             putUInt32((*list)[i]);
@@ -385,12 +394,14 @@ void MtpDataPacket::putAUInt32(const UInt32List* list) {
 }
 
 void MtpDataPacket::putAInt64(const int64_t* values, int count) {
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(int64_t));
     putUInt32(count);
     for (int i = 0; i < count; i++)
         putInt64(*values++);
 }
 
 void MtpDataPacket::putAUInt64(const uint64_t* values, int count) {
+    allocate(mOffset + sizeof(uint32_t) + count * sizeof(uint64_t));
     putUInt32(count);
     for (int i = 0; i < count; i++)
         putUInt64(*values++);
@@ -421,6 +432,14 @@ void MtpDataPacket::putString(const uint16_t* string) {
         putUInt16(0);
 }
 
+void MtpDataPacket::putBytes(const void* data, size_t length) {
+    allocate(mOffset + length);
+    memcpy(mBuffer + mOffset, data, length);
+    mOffset += length;
+    if (mPacketSize < mOffset)
+        mPacketSize = mOffset;
+}
+
 #ifdef MTP_DEVICE 
 int MtpDataPacket::read(int fd) {
     int ret = ::read(fd, mBuffer, MTP_BUFFER_SIZE);
@@ -431,6 +450,42 @@ int MtpDataPacket::read(int fd) {
     return ret;
 }
 
+// most of an incoming data phase that is kept, the rest is read and dropped
+static const size_t kMaxDataPhaseSize = 16 * 1024 * 1024;
+
+int MtpDataPacket::readDataPhase(int fd) {
+    int ret = read(fd);
+    if (ret < 0)
+        return ret;
+
+    size_t length = getContainerLength();
+    size_t kept = std::min(length, kMaxDataPhaseSize);
+    size_t received = mPacketSize;
+
+    // the driver hands out at most MTP_BUFFER_SIZE bytes of a transfer per read
+    allocate(kept + MTP_BUFFER_SIZE);
+    while (received < kept) {
+        ret = ::read(fd, mBuffer + received, MTP_BUFFER_SIZE);
+        if (ret <= 0)
+            return -1;
+        received += ret;
+    }
+    mPacketSize = std::min(received, kMaxDataPhaseSize);
+
+    // the rest is read all the same, or it would be taken for the next request
+    while (received < length) {
+        ret = ::read(fd, mBuffer + kept, MTP_BUFFER_SIZE);
+        if (ret <= 0)
+            return -1;
+        received += ret;
+    }
+
+    if (received > kMaxDataPhaseSize)
+        LOG(WARNING) << "dropped the last " << received - kMaxDataPhaseSize
+                     << " bytes of a " << received << " bytes data phase";
+    return mPacketSize;
+}
+
 int MtpDataPacket::write(int fd) {
     MtpPacket::putUInt32(MTP_CONTAINER_LENGTH_OFFSET, mPacketSize);
     MtpPacket::putUInt16(MTP_CONTAINER_TYPE_OFFSET, MTP_CONTAINER_TYPE_DATA);
@@ -47,7 +47,19 @@ MtpPacket::~MtpPacket() {
         free(mBuffer);
 }
 
+// buffers grown past this for a large packet are given back on reset
+static const size_t kMaxRetainedBufferSize = 256 * 1024;
+
 void MtpPacket::reset() {
+    if (mBufferSize > kMaxRetainedBufferSize) {
+        free(mBuffer);
+        mBuffer = (uint8_t *)malloc(mAllocationIncrement);
+        if (!mBuffer) {
+            LOG(FATAL) << "out of memory!";
+            abort();
+        }
+        mBufferSize = mAllocationIncrement;
+    }
     allocate(MTP_CONTAINER_HEADER_SIZE);
     mPacketSize = MTP_CONTAINER_HEADER_SIZE;
     memset(mBuffer, 0, mBufferSize);
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <iomanip>
 #include <cstdio>
 #include <cstdlib>
@@ -118,7 +119,9 @@ MtpServer::MtpServer(int fd, MtpDatabase* database, bool ptp,
         mSessionOpen(false),
         mSendObjectHandle(kInvalidObjectHandle),
         mSendObjectFormat(0),
-        mSendObjectFileSize(0)
+        mSendObjectFileSize(0),
+        mResponseCacheGeneration(0),
+        mResponseCacheBytes(0)
 {
 }
 
@@ -129,6 +132,7 @@ void MtpServer::addStorage(MtpStorage* storage) {
     MtpAutolock autoLock(mMutex);
 
     mStorages.push_back(storage);
+    clearResponseCache();
     sendStoreAdded(storage->getStorageID());
 }
 
@@ -138,6 +142,7 @@ void MtpServer::removeStorage(MtpStorage* storage) {
     for (size_t i = 0; i < mStorages.size(); i++) {
         if (mStorages[i] == storage) {
             mStorages.erase(mStorages.begin()+i);
+            clearResponseCache();
             sendStoreRemoved(storage->getStorageID());
             break;
         }
@@ -182,7 +187,7 @@ void MtpServer::run() {
                     || operation == MTP_OPERATION_SET_OBJECT_PROP_VALUE
                     || operation == MTP_OPERATION_SET_DEVICE_PROP_VALUE);
         if (dataIn) {
-            int ret = mData.read(fd);
+            int ret = mData.readDataPhase(fd);
             if (ret < 0) {
                 PLOG(ERROR) << "data read returned " << ret;
                 if (errno == ECANCELED) {
@@ -238,8 +243,10 @@ void MtpServer::run() {
     int count = mObjectEditList.size();
     for (int i = 0; i < count; i++) {
         ObjectEdit* edit = mObjectEditList[i];
+        MtpString path = edit->mPath;
         commitEdit(edit);
         delete edit;
+        mDatabase->endPathMutation(path);
     }
     mObjectEditList.clear();
 
@@ -264,6 +271,11 @@ void MtpServer::sendObjectUpdated(MtpObjectHandle handle) {
     sendEvent(MTP_EVENT_OBJECT_PROP_CHANGED, handle, 0, 0);
 }
 
+void MtpServer::sendObjectInfoChanged(MtpObjectHandle handle) {
+    VLOG(1) << "sendObjectInfoChanged " << handle;
+    sendEvent(MTP_EVENT_OBJECT_INFO_CHANGED, handle, 0, 0);
+}
+
 MtpStorage* MtpServer::getStorageLocked(MtpStorageID id) {
     if (id == 0)
         return mStorages.empty() ? NULL : mStorages[0];
@@ -300,6 +312,7 @@ void MtpServer::sendEvent(MtpEventCode code,
                           uint32_t param1,
                           uint32_t param2,
                           uint32_t param3) {
+    MtpAutolock autoLock(mEventMutex);
     if (mSessionOpen) {
         mEvent.setEventCode(code);
         mEvent.setTransactionID(mRequest.getTransactionID());
@@ -315,6 +328,7 @@ void MtpServer::addEditObject(MtpObjectHandle handle, MtpString& path,
         uint64_t size, MtpObjectFormat format, int fd) {
     ObjectEdit*  edit = new ObjectEdit(handle, path, size, format, fd);
     mObjectEditList.push_back(edit);
+    mDatabase->beginPathMutation(path);
 }
 
 MtpServer::ObjectEdit* MtpServer::getEditObject(MtpObjectHandle handle) {
@@ -331,8 +345,11 @@ void MtpServer::removeEditObject(MtpObjectHandle handle) {
     for (int i = 0; i < count; i++) {
         ObjectEdit* edit = mObjectEditList[i];
         if (edit->mHandle == handle) {
+            MtpString path = edit->mPath;
+            // the file is closed with the edit
             delete edit;
             mObjectEditList.erase(mObjectEditList.begin() + i);
+            mDatabase->endPathMutation(path);
             return;
         }
     }
@@ -343,6 +360,85 @@ void MtpServer::commitEdit(ObjectEdit* edit) {
     mDatabase->endSendObject(edit->mPath.c_str(), edit->mHandle, edit->mFormat, true);
 }
 
+// queries whose answer only depends on their parameters and the database
+bool MtpServer::isCacheable(MtpOperationCode operation) {
+    switch (operation) {
+        case MTP_OPERATION_GET_OBJECT_HANDLES:
+        case MTP_OPERATION_GET_NUM_OBJECTS:
+        case MTP_OPERATION_GET_OBJECT_PROP_LIST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool MtpServer::replayResponse(MtpOperationCode operation, uint64_t generation) {
+    if (generation == 0 || !isCacheable(operation))
+        return false;
+
+    if (generation != mResponseCacheGeneration) {
+        clearResponseCache();
+        mResponseCacheGeneration = generation;
+        return false;
+    }
+
+    int count = mRequest.getParameterCount();
+    for (size_t i = mResponseCache.size(); i-- > 0; ) {
+        CachedResponse& cached = mResponseCache[i];
+        if (cached.mOperation != operation || (int)cached.mParameters.size() != count)
+            continue;
+
+        bool match = true;
+        for (int j = 0; j < count && match; j++)
+            match = cached.mParameters[j] == mRequest.getParameter(j + 1);
+        if (!match)
+            continue;
+
+        VLOG(2) << "replaying cached response";
+        if (!cached.mData.empty())
+            mData.putBytes(&cached.mData[0], cached.mData.size());
+        for (size_t j = 0; j < cached.mResponseParameters.size(); j++)
+            mResponse.setParameter(j + 1, cached.mResponseParameters[j]);
+
+        std::rotate(mResponseCache.begin() + i, mResponseCache.begin() + i + 1, mResponseCache.end());
+        return true;
+    }
+    return false;
+}
+
+void MtpServer::cacheResponse(MtpOperationCode operation, uint64_t generation) {
+    static const size_t kMaxEntries = 16;
+    static const size_t kMaxBytes = 8 * 1024 * 1024;
+
+    size_t length = mData.getDataLength();
+    if (generation == 0 || generation != mResponseCacheGeneration
+            || !isCacheable(operation) || length > kMaxBytes)
+        return;
+
+    while (!mResponseCache.empty()
+            && (mResponseCache.size() >= kMaxEntries
+                || mResponseCacheBytes + length > kMaxBytes)) {
+        mResponseCacheBytes -= mResponseCache.front().mData.size();
+        mResponseCache.erase(mResponseCache.begin());
+    }
+
+    CachedResponse cached;
+    cached.mOperation = operation;
+    for (int i = 0; i < mRequest.getParameterCount(); i++)
+        cached.mParameters.push_back(mRequest.getParameter(i + 1));
+    for (int i = 0; i < mResponse.getParameterCount(); i++)
+        cached.mResponseParameters.push_back(mResponse.getParameter(i + 1));
+    cached.mData.assign(mData.getData(), mData.getData() + length);
+
+    mResponseCacheBytes += length;
+    mResponseCache.push_back(cached);
+}
+
+void MtpServer::clearResponseCache() {
+    mResponseCache.clear();
+    mResponseCacheBytes = 0;
+}
+
 bool MtpServer::handleRequest() {
     MtpAutolock autoLock(mMutex);
 
@@ -366,6 +462,13 @@ bool MtpServer::handleRequest() {
     VLOG(2) << "got command " << MtpDebug::getOperationCodeName(operation)
             << ", " << std::hex << operation << std::dec;
 
+    // read before the database is, so answers are never filed as newer than they are
+    uint64_t generation = mDatabase->getGeneration();
+    if (replayResponse(operation, generation)) {
+        mResponse.setResponseCode(MTP_RESPONSE_OK);
+        return true;
+    }
+
     switch (operation) {
         case MTP_OPERATION_GET_DEVICE_INFO:
             response = doGetDeviceInfo();
@@ -466,6 +569,8 @@ bool MtpServer::handleRequest() {
 
     if (response == MTP_RESPONSE_TRANSACTION_CANCELLED)
         return false;
+    if (response == MTP_RESPONSE_OK)
+        cacheResponse(operation, generation);
     mResponse.setResponseCode(response);
     return true;
 }
@@ -535,6 +640,7 @@ MtpResponseCode MtpServer::doOpenSession() {
 
     mSessionID = mRequest.getParameter(1);
     mSessionOpen = true;
+    clearResponseCache();
 
     mDatabase->sessionStarted(this);
 
@@ -546,6 +652,7 @@ MtpResponseCode MtpServer::doCloseSession() {
         return MTP_RESPONSE_SESSION_NOT_OPEN;
     mSessionID = 0;
     mSessionOpen = false;
+    clearResponseCache();
     mDatabase->sessionEnded();
     return MTP_RESPONSE_OK;
 }
@@ -788,11 +895,15 @@ MtpResponseCode MtpServer::doGetObjectInfo() {
         mData.putUInt16(info.mAssociationType);
         mData.putUInt32(info.mAssociationDesc);
         mData.putUInt32(info.mSequenceNumber);
-        mData.putString(info.mName);
-        formatDateTime(info.mDateCreated, date, sizeof(date));
-        mData.putString(date);   // date created
-        formatDateTime(info.mDateModified, date, sizeof(date));
-        mData.putString(date);   // date modified
+        if (!info.mEncodedStrings.empty()) {
+            mData.putBytes(&info.mEncodedStrings[0], info.mEncodedStrings.size());
+        } else {
+            mData.putString(info.mName);
+            formatDateTime(info.mDateCreated, date, sizeof(date));
+            mData.putString(date);   // date created
+            formatDateTime(info.mDateModified, date, sizeof(date));
+            mData.putString(date);   // date modified
+        }
         mData.putEmptyString();   // keywords
     }
     return result;
@@ -996,15 +1107,19 @@ MtpResponseCode MtpServer::doSendObjectInfo() {
     }
 
   if (format == MTP_FORMAT_ASSOCIATION) {
+        mDatabase->beginPathMutation(path);
         mode_t mask = umask(0);
         int ret = mkdir(path.c_str(), mDirectoryPermission);
         umask(mask);
-        if (ret && ret != -EEXIST)
+        if (ret && errno != EEXIST) {
+            mDatabase->endPathMutation(path);
             return MTP_RESPONSE_GENERAL_ERROR;
+        }
         chown(path.c_str(), getuid(), mFileGroup);
 
         // SendObject does not get sent for directories, so call endSendObject here instead
         mDatabase->endSendObject(path, handle, MTP_FORMAT_ASSOCIATION, MTP_RESPONSE_OK);
+        mDatabase->endPathMutation(path);
     } else {
         mSendObjectFilePath = path;
         // save the handle for the SendObject call, which should follow
@@ -1026,6 +1141,7 @@ MtpResponseCode MtpServer::doSendObject() {
     mode_t mask;
     int ret, initialData;
     bool isCanceled = false;
+    bool mutating = false;
 
     if (mSendObjectHandle == kInvalidObjectHandle) {
         LOG(ERROR) << "Expected SendObjectInfo before SendObject";
@@ -1033,6 +1149,9 @@ MtpResponseCode MtpServer::doSendObject() {
         goto done;
     }
 
+    mDatabase->beginPathMutation(mSendObjectFilePath);
+    mutating = true;
+
     // read the header, and possibly some data
     ret = mData.read(mFD);
     if (ret < MTP_CONTAINER_HEADER_SIZE) {
@@ -1098,6 +1217,8 @@ done:
 
     mDatabase->endSendObject(mSendObjectFilePath, mSendObjectHandle, mSendObjectFormat,
             result == MTP_RESPONSE_OK);
+    if (mutating)
+        mDatabase->endPathMutation(mSendObjectFilePath);
     mSendObjectHandle = kInvalidObjectHandle;
     mSendObjectFormat = 0;
     return result;
@@ -1180,7 +1301,9 @@ MtpResponseCode MtpServer::doDeleteObject() {
         result = mDatabase->deleteFile(handle);
         // Don't delete the actual files unless the database deletion is allowed
         if (result == MTP_RESPONSE_OK) {
+            mDatabase->beginPathMutation(filePath);
             deletePath(filePath.c_str());
+            mDatabase->endPathMutation(filePath);
         }
     }
 
@@ -1190,22 +1313,60 @@ MtpResponseCode MtpServer::doDeleteObject() {
 MtpResponseCode MtpServer::doMoveObject() {
     if (!hasStorage())
         return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+    if (mRequest.getParameterCount() < 3)
+        return MTP_RESPONSE_INVALID_PARAMETER;
     MtpObjectHandle handle = mRequest.getParameter(1);
-    MtpObjectFormat format = mRequest.getParameter(2);
+    MtpStorageID storageID = mRequest.getParameter(2);
     MtpObjectHandle newparent = mRequest.getParameter(3);
+    MtpStorage* storage = getStorageLocked(storageID);
+    if (!storage)
+        return MTP_RESPONSE_INVALID_STORAGE_ID;
+
+    MtpObjectInfo info(handle);
+    int result = mDatabase->getObjectInfo(handle, info);
+    if (result != MTP_RESPONSE_OK)
+        return result;
+    // moving across storages would mean copying between file systems
+    if (info.mStorageID != storageID)
+        return MTP_RESPONSE_SPECIFICATION_OF_DESTINATION_UNSUPPORTED;
 
     MtpString filePath;
     MtpString newPath;
     int64_t fileLength;
-    int result = mDatabase->getObjectFilePath(handle, filePath, fileLength, format);
-    result = mDatabase->getObjectFilePath(handle, newPath, fileLength, format);
+    MtpObjectFormat format;
+    result = mDatabase->getObjectFilePath(handle, filePath, fileLength, format);
+    if (result != MTP_RESPONSE_OK)
+        return result;
+
+    // special case the root, which hosts ask for as 0 or 0xFFFFFFFF
+    if (newparent == 0 || newparent == MTP_PARENT_ROOT) {
+        newPath = storage->getPath();
+        newparent = 0;
+    } else {
+        result = mDatabase->getObjectFilePath(newparent, newPath, fileLength, format);
+        if (result != MTP_RESPONSE_OK)
+            return result;
+        if (format != MTP_FORMAT_ASSOCIATION)
+            return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+    }
+
+    if (newPath[newPath.size() - 1] != '/')
+        newPath += "/";
+    newPath += info.mName;
+
+    VLOG(2) << "moving " << filePath.c_str() << " to " << newPath.c_str();
+    result = mDatabase->moveFile(handle, newparent);
+    // Don't move the actual files unless the database move is allowed
     if (result == MTP_RESPONSE_OK) {
-        VLOG(2) << "moving " << filePath.c_str() << " to " << newPath.c_str();
-        result = mDatabase->moveFile(handle, newparent);
-        // Don't move the actual files unless the database deletion is allowed
-        if (result == MTP_RESPONSE_OK) {
-            rename(filePath.c_str(), newPath.c_str());
+        mDatabase->beginPathMutation(filePath);
+        mDatabase->beginPathMutation(newPath);
+        if (rename(filePath.c_str(), newPath.c_str())) {
+            PLOG(ERROR) << "rename " << filePath << " to " << newPath << " failed";
+            mDatabase->moveFile(handle, info.mParent);
+            result = MTP_RESPONSE_GENERAL_ERROR;
         }
+        mDatabase->endPathMutation(newPath);
+        mDatabase->endPathMutation(filePath);
     }
 
     return result;
@@ -152,9 +152,16 @@ bool MtpStringBuffer::readFromPacket(MtpDataPacket* packet) {
 }
 
 void MtpStringBuffer::writeToPacket(MtpDataPacket* packet) const {
+    uint8_t buffer[MTP_STRING_MAX_ENCODED_SIZE];
+
+    packet->putBytes(buffer, encode(buffer));
+}
+
+int MtpStringBuffer::encode(uint8_t* dest) const {
     int count = mCharCount;
     const uint8_t* src = mBuffer;
-    packet->putUInt8(count > 0 ? count + 1 : 0);
+    uint8_t* start = dest;
+    *dest++ = (count > 0 ? count + 1 : 0);
 
     // expand utf8 to 16 bit chars
     for (int i = 0; i < count; i++) {
@@ -173,11 +180,15 @@ void MtpStringBuffer::writeToPacket(MtpDataPacket* packet) const {
             uint16_t ch3 = *src++;
             ch = ((ch1 & 0x0F) << 12) | ((ch2 & 0x3F) << 6) | (ch3 & 0x3F);
         }
-        packet->putUInt16(ch);
+        *dest++ = (uint8_t)(ch & 0xFF);
+        *dest++ = (uint8_t)((ch >> 8) & 0xFF);
     }
     // only terminate with zero if string is not empty
-    if (count > 0)
-        packet->putUInt16(0);
+    if (count > 0) {
+        *dest++ = 0;
+        *dest++ = 0;
+    }
+    return dest - start;
 }
 
 }  // namespace android